@@ -28,6 +28,7 @@
 #include <ESPmDNS.h>
 #include <sodium.h>
 #include <MD5Builder.h>
+#include <lwip/sockets.h>
 #include <mbedtls/version.h>
 
 #include "HAP.h"
@@ -118,145 +119,434 @@ void HAPClient::init(){
 
 void HAPClient::processRequest(){
 
-  int nBytes, messageSize;
+  int nBytes=client.available();
 
-  messageSize=client.available();        
-
-  if(messageSize>MAX_HTTP){                         // exceeded maximum number of bytes allowed
-    badRequestError();
-    LOG0("\n*** ERROR:  HTTP message of %d bytes exceeds maximum allowed (%d)\n\n",messageSize,MAX_HTTP);
-    return;
-  }
- 
-  TempBuffer<uint8_t> httpBuf(messageSize+1);      // leave room for null character added below
-  
   if(cPair){                                       // expecting encrypted message
-    LOG2("<<<< #### ");
-    LOG2(client.remoteIP());
-    LOG2(" #### <<<<\n");
-
-    nBytes=receiveEncrypted(httpBuf,messageSize);  // decrypt and return number of bytes read      
-        
-    if(!nBytes){                                   // decryption failed (error message already printed in function)
-      badRequestError();              
-      return;          
+    if(!receiveEncrypted(nBytes)){                 // decrypt any completed frames (error message already printed in function)
+      badRequestError();
+      clearRequest();
+      return;
     }
         
   } else {                                         // expecting plaintext message  
-    LOG2("<<<<<<<<< ");
-    LOG2(client.remoteIP());
-    LOG2(" <<<<<<<<<\n");
-    
-    nBytes=client.read(httpBuf,messageSize);       // read expected number of bytes
 
-    if(nBytes!=messageSize || client.available()!=0){
+    if(httpLen+nBytes>MAX_HTTP)                    // read no more than maximum number of bytes allowed - any remaining bytes (e.g. from pipelined requests) are read on next poll
+      nBytes=MAX_HTTP-httpLen;
+
+    if(!growBuffer(httpBuf,httpCap,httpLen+nBytes+1)){             // leave room for null character added below
+      badRequestError();
+      clearRequest();
+      return;
+    }
+
+    int nRead=client.read(httpBuf+httpLen,nBytes);                 // read all available bytes
+
+    if(nRead!=nBytes){
       badRequestError();
-      LOG0("\n*** ERROR:  HTTP message not read correctly.  Expected %d bytes, read %d bytes, %d bytes remaining\n\n",messageSize,nBytes,client.available());
+      LOG0("\n*** ERROR:  HTTP message not read correctly.  Expected %d bytes, read %d bytes\n\n",nBytes,nRead);
+      clearRequest();
       return;
     }
-               
+
+    httpLen+=nBytes;
   } // encrypted/plaintext
+
+  while(httpLen>0){                                // process every complete request in buffer (HTTP/1.1 pipelining)
+
+    boolean wasEncrypted=(cPair!=NULL);
+    int mLen;                                      // number of bytes consumed from buffer
+
+    if(streamLen>0){                               // in the middle of streaming Content of a large PUT /characteristics request
+    
+      if((mLen=streamCharacteristics())<=0){       // parse and load any complete characteristic objects
+        if(mLen<0)                                 // error (response already sent and error message already printed in function)
+          clearRequest();
+        return;                                    // wait for more data
+      }
+
+      httpLen-=mLen;
+      memmove(httpBuf,httpBuf+mLen,httpLen);      // shift any remaining bytes to start of buffer
       
-  httpBuf[nBytes]='\0';   // add null character to enable string functions
+    } else {
       
-  char *body=(char *)httpBuf.get();   // char pointer to start of HTTP Body
-  char *p;                            // char pointer used for searches
-     
-  if(!(p=strstr((char *)httpBuf.get(),"\r\n\r\n"))){
+      httpBuf[httpLen]='\0';   // add null character to enable string functions
+        
+      char *body=(char *)httpBuf;         // char pointer to start of HTTP Body
+      char *p;                            // char pointer used for searches
+       
+      if(!(p=(char *)memmem(httpBuf,httpLen,"\r\n\r\n",4))){      // have not yet received blank line indicating end of BODY
+        if(httpLen>=MAX_HTTP){
+          badRequestError();
+          LOG0("\n*** ERROR:  Malformed HTTP request (can't find blank line indicating end of BODY)\n\n");
+          clearRequest();
+        }
+        return;                           // wait for more data
+      }
+  
+      char *eob=p;                        // char pointer to end of HTTP Body
+      HttpRequest req;
+  
+      if(!req.parse(body,eob-body)){      // index request line and headers
+        badRequestError();
+        LOG0("\n*** ERROR:  Malformed HTTP request line\n\n");
+        clearRequest();
+        return;
+      }
+  
+      *eob='\0';                          // null-terminate end of HTTP Body to faciliate additional string processing
+      req.content=(uint8_t *)eob+4;       // byte pointer to start of optional HTTP Content
+      int cLen=req.contentLength;         // length of optional HTTP Content
+      int hLen=(eob-body)+4;              // length of HTTP Body, including blank line
+  
+      boolean streaming=(cPair && cLen>MAX_HTTP-hLen && isStreamable(req));   // Content is too large to buffer, but can be streamed
+      
+      mLen=hLen+cLen;                     // total length of HTTP message
+  
+      if(cLen<0 || (streaming?cLen>MAX_STREAM:(cLen>MAX_HTTP || mLen>MAX_HTTP))){
+        badRequestError();
+        LOG0("\n*** ERROR:  HTTP message of %d bytes exceeds maximum allowed (%d)\n\n",mLen,streaming?MAX_STREAM:MAX_HTTP);
+        clearRequest();
+        return;
+      }
+  
+      if(!streaming && httpLen<mLen){     // have not yet received all Content
+        *eob='\r';                        // restore blank line so it can be found again once more data arrives
+        return;                           // wait for more data
+      }
+  
+      if(cPair){
+        LOG2("<<<< #### ");
+        LOG2(client.remoteIP());
+        LOG2(" #### <<<<\n");
+      } else {
+        LOG2("<<<<<<<<< ");
+        LOG2(client.remoteIP());
+        LOG2(" <<<<<<<<<\n");
+      }
+  
+      LOG2(body);
+      LOG2("\n------------ END BODY! ------------\n");
+
+      if(streaming){                      // start streaming Content - HTTP Body is discarded and Content is processed as it arrives
+        LOG1("In Put Characteristics #%d (%s)...\n",conNum,client.remoteIP().toString().c_str());
+        LOG2("Streaming %d bytes of Content\n",cLen);
+        streamLen=cLen;
+        streamLogged=0;
+        putState=0;
+        putTWFail=false;
+        clearPut();
+        mLen=hLen;
+      } else {
+        uint8_t savedByte=httpBuf[mLen];    // save first byte of any pipelined request that follows...
+        httpBuf[mLen]='\0';                 // ...and temporarily replace with null character so Content of this request is properly terminated
+
+        dispatchRequest(req);               // process complete request
+
+        httpBuf[mLen]=savedByte;
+      }
+  
+      if(!client){                          // connection was closed by handler (e.g. after an error) - discard anything else received
+        clearRequest();
+        return;
+      }
+  
+      httpLen-=mLen;
+      memmove(httpBuf,httpBuf+mLen,httpLen);          // shift any bytes from next pipelined request to start of buffer
+    }
+
+    if(!wasEncrypted && cPair && httpLen>0){        // connection just became verified - any remaining bytes are encrypted frames, not plaintext
+      rawStart=0;                                   // since buffer holds no other data, remaining bytes can be decrypted in place
+      rawLen=httpLen;
+      httpLen=0;
+    }
+
+    if(cPair && rawLen>0 && !receiveEncrypted(0)){  // decrypt any frames that were deferred while buffer was full
+      badRequestError();
+      clearRequest();
+      return;
+    }
+    
+  } // while
+
+} // processRequest
+
+//////////////////////////////////////
+
+void HAPClient::dispatchRequest(HttpRequest &req){
+
+  if((req.isMethod("POST") || req.isMethod("PUT")) && req.contentLength==0){
     badRequestError();
-    LOG0("\n*** ERROR:  Malformed HTTP request (can't find blank line indicating end of BODY)\n\n");
-    return;      
+    LOG0("\n*** ERROR:  HTTP %.*s request contains no Content\n\n",(int)req.methodLen,req.method);
+    return;
+  }
+
+  if(req.isMethod("PUT")){
+    LOG2((char *)req.content);
+    LOG2("\n------------ END JSON! ------------\n");
+  }
+
+  for(int i=0;routes[i].method;i++){                  // check HAP routing table
+    if(matchRoute(routes[i],req)){
+      routes[i].handler(this,req);
+      return;
+    }
+  }
+
+  if(req.isMethod("POST") || req.isMethod("PUT") || req.isMethod("GET")){
+    notFoundError();
+    LOG0("\n*** ERROR:  Bad %.*s request - URL not found\n\n",(int)req.methodLen,req.method);
+    return;
   }
+      
+  badRequestError();
+  LOG0("\n*** ERROR:  Unknown or malformed HTTP request\n\n");
+                        
+} // dispatchRequest
 
-  *p='\0';                            // null-terminate end of HTTP Body to faciliate additional string processing
-  uint8_t *content=(uint8_t *)p+4;    // byte pointer to start of optional HTTP Content
-  int cLen=0;                         // length of optional HTTP Content
+//////////////////////////////////////
+
+int HAPClient::streamCharacteristics(){
+
+  int nBytes=(httpLen<streamLen)?httpLen:streamLen;     // number of bytes of Content available in buffer
+  boolean lastChunk=(nBytes==streamLen);                 // all remaining Content has been received
+
+  if(nBytes>streamLogged){                               // log only bytes not already logged with a previous chunk
+    LOG2("%.*s",nBytes-streamLogged,(char *)httpBuf+streamLogged);
+    LOG2("\n------------ END JSON CHUNK! ------------\n");
+  }
 
-  if((p=strstr(body,"Content-Length: ")))       // Content-Length is specified
-    cLen=atoi(p+16);
-  if(nBytes!=strlen(body)+4+cLen){
+  int cLen=putCharacteristics((char *)httpBuf,nBytes,lastChunk);     // number of bytes consumed (any incomplete object is retained for next chunk)
+
+  if(cLen<0)                                             // error (response already sent and error message already printed in function)
+    return(-1);
+
+  streamLogged=nBytes-cLen;                              // bytes retained for next chunk have already been logged
+
+  if(lastChunk){
+    cLen=nBytes;
+  } else if(cLen==0 && nBytes>=MAX_HTTP){               // no complete object found in full buffer
     badRequestError();
-    LOG0("\n*** ERROR:  Malformed HTTP request (Content-Length plus Body Length does not equal total number of bytes read)\n\n");
-    return;        
+    LOG0("\n*** ERROR:  Problems parsing JSON - characteristic object exceeds maximum allowed size (%d)\n\n",MAX_HTTP);
+    return(-1);
   }
 
-  LOG2(body);
-  LOG2("\n------------ END BODY! ------------\n");
+  streamLen-=cLen;
+  return(cLen);
+}
 
-  if(!strncmp(body,"POST ",5)){                                                                                        // this is a POST request
+//////////////////////////////////////
 
-    if(cLen==0){
-      badRequestError();
-      LOG0("\n*** ERROR:  HTTP POST request contains no Content\n\n");
-    }
-           
-    else if(!strncmp(body,"POST /pair-setup ",17) && strstr(body,"Content-Type: application/pairing+tlv8"))            // POST PAIR-SETUP               
-      postPairSetupURL(content,cLen);
+int HAPClient::putCharacteristics(char *json, int len, boolean lastChunk){
 
-    else if(!strncmp(body,"POST /pair-verify ",18) && strstr(body,"Content-Type: application/pairing+tlv8"))           // POST PAIR-VERIFY 
-      postPairVerifyURL(content,cLen);
-            
-    else if(!strncmp(body,"POST /pairings ",15) && strstr(body,"Content-Type: application/pairing+tlv8"))              // POST PAIRINGS                
-      postPairingsURL(content,cLen);
+  SpanBuf pObj[PUT_POOL];                                // fixed-size pool into which each batch of objects is parsed
+  char *p=json;
+  int n;
 
-    else {
-      notFoundError();
-      LOG0("\n*** ERROR:  Bad POST request - URL not found\n\n");
+  while((n=homeSpan.parseCharacteristics(p,json+len,pObj,PUT_POOL,putState,putTWFail))>0){
+    for(int i=0;i<n;i++){                                // save objects, copying values since Content is discarded as it is streamed
+      putRefs.push_back(putVals.size());
+      if(pObj[i].val){
+        putVals.insert(putVals.end(),pObj[i].val,pObj[i].val+strlen(pObj[i].val)+1);
+        pObj[i].val=(char *)"";                          // non-NULL placeholder indicates a value was written
+      }
+      if(pObj[i].ev){
+        putVals.insert(putVals.end(),pObj[i].ev,pObj[i].ev+strlen(pObj[i].ev)+1);
+        pObj[i].ev=(char *)"";
+      }
+      putObj.push_back(pObj[i]);
     }
-    
-    return;                          
-  } // POST request
-          
-  if(!strncmp(body,"PUT ",4)){                                                                                         // this is a PUT request
+  }
 
-    if(cLen==0){
-      badRequestError();
-      LOG0("\n*** ERROR:  HTTP PUT request contains no Content\n\n");
-      return;
-    }
+  if(n==0 && lastChunk && putState!=3){
+    LOG0("\n*** ERROR:  Problems parsing JSON - characteristics request is incomplete\n\n");
+    n=-1;
+  }
 
-    LOG2((char *)content);
-    LOG2("\n------------ END JSON! ------------\n");    
-           
-    if(!strncmp(body,"PUT /characteristics ",21) && strstr(body,"Content-Type: application/hap+json"))                 // PUT CHARACTERISTICS              
-      putCharacteristicsURL((char *)content);
+  if(n<0){                                               // error message already printed (nothing has yet been loaded, so there is nothing to revert)
+    clearPut();
+    badRequestError();
+    return(-1);
+  }
 
-    else if(!strncmp(body,"PUT /prepare ",13) && strstr(body,"Content-Type: application/hap+json"))                    // PUT PREPARE
-      putPrepareURL((char *)content);
+  if(lastChunk){                                         // all Content has been received and parsed
 
-    else {
-      notFoundError();
-      LOG0("\n*** ERROR:  Bad PUT request - URL not found\n\n");
+    for(int i=0;i<putObj.size();i++){                    // point each object to its saved value and ev strings
+      char *v=putVals.data()+putRefs[i];
+      if(putObj[i].val){
+        putObj[i].val=v;
+        v+=strlen(v)+1;
+      }
+      if(putObj[i].ev)
+        putObj[i].ev=v;
     }
-    
-    return;                  
-        
-  } // PUT request           
-      
-  if(!strncmp(body,"GET ",4)){                                                                                         // this is a GET request
-                    
-    if(!strncmp(body,"GET /accessories ",17))                                                                          // GET ACCESSORIES
-      getAccessoriesURL();
 
-    else if(!strncmp(body,"GET /characteristics?",21))                                                                 // GET CHARACTERISTICS
-      getCharacteristicsURL(body+21);
+    homeSpan.loadCharacteristics(putObj.data(),putObj.size(),putTWFail);       // PASS 1: load all updates (or mark all as failed if Timed Write expired or has no PID)
+    homeSpan.commitCharacteristics(putObj.data(),putObj.size());               // PASS 2: update services and store values
+    putCharacteristicsResponse(putObj.data(),putObj.size());
+
+    clearPut();
+  }
+
+  return(p-json);
+}
+
+//////////////////////////////////////
+
+void HAPClient::clearPut(){
 
-    else if(homeSpan.webLog.isEnabled && !strncmp(body,homeSpan.webLog.statusURL.c_str(),homeSpan.webLog.statusURL.length()))       // GET STATUS - AN OPTIONAL, NON-HAP-R2 FEATURE
-      getStatusURL(this,NULL,NULL);
+  putObj.clear();
+  putRefs.clear();
+  putVals.clear();
+
+  if(putObj.capacity()>PUT_POOL){                        // retain a modest capacity for reuse, but release storage from unusually large requests
+    putObj.shrink_to_fit();
+    putRefs.shrink_to_fit();
+  }
+  if(putVals.capacity()>PUT_POOL*32)
+    putVals.shrink_to_fit();
+}
+
+//////////////////////////////////////
+
+boolean HAPClient::isStreamable(HttpRequest &req){
+
+  for(int i=0;routes[i].method;i++){
+    if(routes[i].streamable && matchRoute(routes[i],req))
+      return(true);
+  }
+
+  return(false);
+}
 
-    else {
-      notFoundError();
-      LOG0("\n*** ERROR:  Bad GET request - URL not found\n\n");
+//////////////////////////////////////
+
+boolean HAPClient::matchRoute(const Route &route, HttpRequest &req){
+
+  if(!req.isMethod(route.method))
+    return(false);
+
+  const char *path=route.path;
+  size_t pathLen;
+
+  if(path){
+    pathLen=strlen(path);
+  } else {                                            // optional Web Log status URL, stored in the form "GET /status "
+    if(!homeSpan.webLog.isEnabled)
+      return(false);
+    path=homeSpan.webLog.statusURL.c_str()+4;
+    pathLen=homeSpan.webLog.statusURL.length()-5;
+  }
+
+  if(req.pathLen!=pathLen || strncmp(req.path,path,pathLen))
+    return(false);
+
+  if(route.contentType){                              // Content-Type must start with required type (any parameters, such as charset, are ignored)
+    size_t typeLen=strlen(route.contentType);
+    if(req.contentTypeLen<typeLen || strncasecmp(req.contentType,route.contentType,typeLen))
+      return(false);
+  }
+
+  return(true);
+}
+
+//////////////////////////////////////
+
+boolean HttpRequest::parse(char *header, size_t len){
+
+  char *end=header+len;
+  char *p=header;
+
+  method=p;                                               // request line has the form: METHOD PATH[?QUERY] HTTP/1.1
+  while(p<end && *p!=' ')
+    p++;
+  methodLen=p-method;
+
+  if(p==end || methodLen==0)
+    return(false);
+
+  path=++p;
+  while(p<end && *p!=' ' && *p!='?')
+    p++;
+  pathLen=p-path;
+
+  if(p<end && *p=='?'){
+    query=++p;
+    while(p<end && *p!=' ')
+      p++;
+    queryLen=p-query;
+  }
+
+  if(p==end || pathLen==0)
+    return(false);
+
+  while((p=(char *)memchr(p,'\n',end-p))){            // advance to start of each header line (header names are case-insensitive)
+    p++;
+
+    if(end-p>15 && !strncasecmp(p,"Content-Length:",15)){
+      p+=15;
+      contentLength=strtol(p,&p,10);                     // strtol() skips any leading whitespace
     }
     
-    return;                  
+    else if(end-p>13 && !strncasecmp(p,"Content-Type:",13)){
+      p+=13;
+      while(p<end && (*p==' ' || *p=='\t'))
+        p++;
+      contentType=p;
+      while(p<end && *p!='\r' && *p!='\n')
+        p++;
+      contentTypeLen=p-contentType;
+    }
+  }
 
-  } // GET request
-      
-  badRequestError();
-  LOG0("\n*** ERROR:  Unknown or malformed HTTP request\n\n");
-                        
-} // processHAP
+  return(true);
+}
+
+//////////////////////////////////////
+
+void HAPClient::clearRequest(){
+
+  if(streamLen>0){                                        // abandon streaming of PUT /characteristics request (nothing has yet been loaded, so there is nothing to revert)
+    clearPut();
+    streamLen=0;
+  }
+  
+  rawStart=0;
+  rawLen=0;
+  httpLen=0;
+}
+
+//////////////////////////////////////
+
+void HAPClient::releaseBuffers(){
+
+  free(httpBuf);
+  httpBuf=NULL;
+  httpCap=0;
+  free(sendBuf);
+  sendBuf=NULL;
+  sendLen=0;
+  clearRequest();
+}
+
+//////////////////////////////////////
+
+boolean HAPClient::growBuffer(uint8_t *&buf, size_t &cap, size_t nBytes){
+
+  if(nBytes<=cap)                         // existing buffer is already large enough
+    return(true);
+
+  size_t newCap=(nBytes+511)&~511;        // round up to next multiple of 512 bytes to reduce number of re-allocations as request grows
+  uint8_t *newBuf=(uint8_t *)HS_REALLOC(buf,newCap);
+
+  if(newBuf==NULL){
+    LOG0("\n*** ERROR:  Can't allocate %d bytes for HTTP request buffer\n\n",newCap);
+    return(false);
+  }
+
+  buf=newBuf;
+  cap=newCap;
+  return(true);
+}
 
 //////////////////////////////////////
 
@@ -267,6 +557,7 @@ int HAPClient::notFoundError(){
   LOG2(client.remoteIP());
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
+  flushSend();
   client.print(s);
   LOG2("------------ SENT! --------------\n");
   
@@ -285,6 +576,7 @@ int HAPClient::badRequestError(){
   LOG2(client.remoteIP());
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
+  flushSend();
   client.print(s);
   LOG2("------------ SENT! --------------\n");
   
@@ -303,6 +595,7 @@ int HAPClient::unauthorizedError(){
   LOG2(client.remoteIP());
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
+  flushSend();
   client.print(s);
   LOG2("------------ SENT! --------------\n");
   
@@ -894,15 +1187,27 @@ int HAPClient::getAccessoriesURL(){
 
   LOG1("In Get Accessories #%d (%s)...\n",conNum,client.remoteIP().toString().c_str());
 
-  homeSpan.printfAttributes();
-  size_t nBytes=hapOut.getSize();
-  hapOut.flush();
+  boolean cached=homeSpan.loadAccessoriesCache();     // (re)build cached response if needed
+  size_t nBytes;
+
+  if(cached){
+    nBytes=homeSpan.sizeCachedAttributes();           // Content-Length is cached length plus length of each current value, so response can be streamed directly
+  } else {
+    hapOut.spool();                                   // serialize attribute database once, capturing output so Content-Length is known before HTTP header is sent
+    homeSpan.printfAttributes();
+    nBytes=hapOut.endSpool();
+  }
 
   LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
 
   hapOut.setLogLevel(2).setHapClient(this);    
   hapOut << "HTTP/1.1 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
-  homeSpan.printfAttributes();
+  if(cached)
+    homeSpan.printfCachedAttributes();
+  else if(hapOut.isSpooled())
+    hapOut.writeSpool();
+  else
+    homeSpan.printfAttributes();                      // database was too large to spool - serialize it again
   hapOut.flush();
 
   LOG2("\n-------- SENT ENCRYPTED! --------\n");
@@ -965,13 +1270,16 @@ int HAPClient::getCharacteristicsURL(char *urlBuf){
   if(!numIDs)           // could not find any IDs
     return(0);
 
+  hapOut.spool();
   boolean statusFlag=homeSpan.printfAttributes(ids,numIDs,flags);     // get statusFlag returned to use below
-  size_t nBytes=hapOut.getSize();
-  hapOut.flush();
+  size_t nBytes=hapOut.endSpool();
 
   hapOut.setLogLevel(2).setHapClient(this);
   hapOut << "HTTP/1.1 " << (!statusFlag?"200 OK":"207 Multi-Status") << "\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
-  homeSpan.printfAttributes(ids,numIDs,flags);
+  if(hapOut.isSpooled())
+    hapOut.writeSpool();
+  else
+    homeSpan.printfAttributes(ids,numIDs,flags);
   hapOut.flush();
 
   LOG2("\n-------- SENT ENCRYPTED! --------\n");
@@ -990,13 +1298,16 @@ int HAPClient::putCharacteristicsURL(char *json){
 
   LOG1("In Put Characteristics #%d (%s)...\n",conNum,client.remoteIP().toString().c_str());
 
-  int n=homeSpan.countCharacteristics(json);    // count number of objects in JSON request
-  if(n==0)                                      // if no objects found, return
-    return(0);
- 
-  SpanBuf pObj[n];                                        // reserve space for objects
-  if(!homeSpan.updateCharacteristics(json, pObj))         // perform update
-    return(0);                                            // return if failed to update (error message will have been printed in update)
+  putState=0;
+  putTWFail=false;
+  clearPut();
+
+  return(putCharacteristics(json,strlen(json),true)>=0);
+}
+
+//////////////////////////////////////
+
+void HAPClient::putCharacteristicsResponse(SpanBuf *pObj, int n){
 
   int multiCast=0;                                        // check if all status is OK, or if multicast response is request
   for(int i=0;i<n;i++)
@@ -1013,13 +1324,16 @@ int HAPClient::putCharacteristicsURL(char *json){
         
   } else {                                                // multicast respose is required
 
+    hapOut.spool();
     homeSpan.printfAttributes(pObj,n);
-    size_t nBytes=hapOut.getSize();
-    hapOut.flush();
+    size_t nBytes=hapOut.endSpool();
   
     hapOut.setLogLevel(2).setHapClient(this);
     hapOut << "HTTP/1.1 207 Multi-Status\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
-    homeSpan.printfAttributes(pObj,n);
+    if(hapOut.isSpooled())
+      hapOut.writeSpool();
+    else
+      homeSpan.printfAttributes(pObj,n);
     hapOut.flush(); 
   }
 
@@ -1028,8 +1342,6 @@ int HAPClient::putCharacteristicsURL(char *json){
   // Create and send Event Notifications if needed
 
   eventNotify(pObj,n,HAPClient::conNum);                  // transmit EVENT Notification for "n" pObj objects, except DO NOT notify client making request
-    
-  return(1);
 }
 
 //////////////////////////////////////
@@ -1066,13 +1378,12 @@ int HAPClient::putPrepareURL(char *json){
 
   LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
 
-  hapOut << "{\"status\":" << (int)status << "}";
-  size_t nBytes=hapOut.getSize();
-  hapOut.flush();
+  char body[32];
+  int nBytes=sprintf(body,"{\"status\":%d}",(int)status);
 
   hapOut.setLogLevel(2).setHapClient(this);    
   hapOut << "HTTP/1.1 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
-  hapOut << "{\"status\":" << (int)status << "}";
+  hapOut << body;
   hapOut.flush();
 
   LOG2("\n-------- SENT ENCRYPTED! --------\n");
@@ -1216,7 +1527,7 @@ void HAPClient::getStatusURL(HAPClient *hapClient, void (*callBack)(const char *
   hapOut.flush();
 
   if(hapClient){
-    hapClient->client.stop();
+    hapClient->stopClient();
     LOG2("------------ SENT! --------------\n");
   }
 }
@@ -1226,8 +1537,11 @@ void HAPClient::getStatusURL(HAPClient *hapClient, void (*callBack)(const char *
 void HAPClient::checkNotifications(){
 
   if(!homeSpan.Notifications.empty()){                                          // if there are Notifications to process    
-    eventNotify(&homeSpan.Notifications[0],homeSpan.Notifications.size());      // transmit EVENT Notifications
-    homeSpan.Notifications.clear();                                             // clear Notifications vector
+    int nDue=homeSpan.prepareNotifications();                                   // find Notifications that are due (others are deferred by rate limit)
+    if(nDue>0){
+      eventNotify(&homeSpan.Notifications[0],nDue);                             // transmit EVENT Notifications
+      homeSpan.clearNotifications(nDue);                                        // remove transmitted Notifications
+    }
   }
 }
 
@@ -1251,28 +1565,66 @@ void HAPClient::checkTimedWrites(){
 
 //////////////////////////////////////
 
+void HAPClient::setNotify(uint16_t n, boolean flag){
+
+  if(n/32>=notifyBits.size()){
+    if(!flag)                           // nothing to clear
+      return;
+    notifyBits.resize(n/32+1,0);
+  }
+
+  if(flag)
+    notifyBits[n/32]|=(1UL<<(n%32));
+  else
+    notifyBits[n/32]&=~(1UL<<(n%32));
+}
+
+//////////////////////////////////////
+
 void HAPClient::eventNotify(SpanBuf *pObj, int nObj, int ignoreClient){
-  
-  for(int cNum=0;cNum<homeSpan.maxConnections;cNum++){      // loop over all connection slots
-    if(hap[cNum]->client && cNum!=ignoreClient){            // if there is a client connected to this slot and it is NOT flagged to be ignored (in cases where it is the client making a PUT request)
 
-      homeSpan.printfNotify(pObj,nObj,cNum);                // create JSON (which may be of zero length if there are no applicable notifications for this cNum)
-      size_t nBytes=hapOut.getSize();
-      hapOut.flush();
+  uint32_t targets=homeSpan.getSubscribers(pObj,nObj);     // set of connections subscribed to at least one updated characteristic
+
+  if(ignoreClient>=0)
+    targets&=~(1UL<<ignoreClient);
+
+  for(int cNum=0;cNum<homeSpan.maxConnections;cNum++){      // remove any slots without a connected client
+    if(!hap[cNum]->client)
+      targets&=~(1UL<<cNum);
+  }
+
+  // Connections subscribed to the same subset of the updated characteristics receive byte-identical EVENT JSON, so each
+  // distinct subset is serialized only once, and the resulting plaintext is then encrypted separately for each connection
+
+  while(targets){
+    
+    int cNum=__builtin_ctz(targets);                                    // first remaining connection
+    uint32_t group=homeSpan.getSubscriberGroup(pObj,nObj,cNum,targets);   // set of remaining connections with same subscription subset as cNum
+    targets&=~group;
+
+    hapOut.spool();
+    homeSpan.printfNotify(pObj,nObj,cNum);                  // create JSON (which may be of zero length if there are no applicable notifications for this cNum)
+    size_t nBytes=hapOut.endSpool();
 
-      if(nBytes>0){                                         // if there ARE notifications to send to client cNum
+    while(nBytes>0 && group){                                // if there ARE notifications to send, send to every connection in group
+      int i=__builtin_ctz(group);
+      group&=group-1;
         
-        LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",hap[cNum]->client.remoteIP().toString().c_str());
+      LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",hap[i]->client.remoteIP().toString().c_str());
 
-        hapOut.setLogLevel(2).setHapClient(hap[cNum]);    
-        hapOut << "EVENT/1.0 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
-        homeSpan.printfNotify(pObj,nObj,cNum);
-        hapOut.flush();
+      hapOut.setLogLevel(2).setHapClient(hap[i]);    
+      hapOut << "EVENT/1.0 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
+      if(hapOut.isSpooled())
+        hapOut.writeSpool(false);
+      else
+        homeSpan.printfNotify(pObj,nObj,i);
+      hapOut.flush();
 
-        LOG2("\n-------- SENT ENCRYPTED! --------\n");
-      }
+      LOG2("\n-------- SENT ENCRYPTED! --------\n");
     }
-  }         
+
+    hapOut.releaseSpool();
+  }
 }
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -1280,12 +1632,12 @@ void HAPClient::eventNotify(SpanBuf *pObj, int nObj, int ignoreClient){
 
 void HAPClient::tlvRespond(TLV8 &tlv8){
 
+  hapOut.spool();
   tlv8.osprint(hapOut);
-  size_t nBytes=hapOut.getSize();
-  hapOut.flush();
+  size_t nBytes=hapOut.endSpool();
   
-  char *body;
-  asprintf(&body,"HTTP/1.1 200 OK\r\nContent-Type: application/pairing+tlv8\r\nContent-Length: %d\r\n\r\n",nBytes);      // create Body with Content Length = size of TLV data
+  char body[96];
+  sprintf(body,"HTTP/1.1 200 OK\r\nContent-Type: application/pairing+tlv8\r\nContent-Length: %d\r\n\r\n",nBytes);      // create Body with Content Length = size of TLV data
 
   LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
   LOG2(body);
@@ -1294,7 +1646,10 @@ void HAPClient::tlvRespond(TLV8 &tlv8){
 
   hapOut.setHapClient(this);
   hapOut << body;
-  tlv8.osprint(hapOut);
+  if(hapOut.isSpooled())
+    hapOut.writeSpool();
+  else
+    tlv8.osprint(hapOut);
   hapOut.flush();
 
   if(!cPair)
@@ -1306,39 +1661,157 @@ void HAPClient::tlvRespond(TLV8 &tlv8){
 
 //////////////////////////////////////
 
-int HAPClient::receiveEncrypted(uint8_t *httpBuf, int messageSize){
+size_t HAPClient::sendData(const uint8_t *buf, size_t len){
 
-  uint8_t aad[2];
-  int nBytes=0;
+  int fd=client.fd();
+  size_t nSent=0;
 
-  while(client.read(aad,2)==2){    // read initial 2-byte AAD record
+  if(fd<0)
+    return(0);
+
+  while(nSent<len){
+    
+    int n=send(fd,buf+nSent,len-nSent,MSG_DONTWAIT);      // write as much as socket send buffer can accept without blocking
+
+    if(n>0){
+      nSent+=n;
+      continue;
+    }
+
+    if(n<0 && errno!=EAGAIN && errno!=EWOULDBLOCK){      // socket error
+      LOG0("\n*** ERROR:  Can't write to client (errno=%d)\n\n",errno);
+      sendLen=0;                                          // discard any other gathered data
+      client.stop();                                      // connection is no longer usable since encrypted frames must be received in sequence
+      return(nSent);
+    }
+
+    fd_set writeSet;                                      // send buffer is full - wait until lwIP frees enough space to continue writing
+    FD_ZERO(&writeSet);
+    FD_SET(fd,&writeSet);
+    struct timeval tv={SEND_TIMEOUT/1000,(SEND_TIMEOUT%1000)*1000};
+
+    if(select(fd+1,NULL,&writeSet,NULL,&tv)<=0){
+      LOG0("\n*** ERROR:  Timed out writing to client after %d ms (%d of %d bytes sent)\n\n",SEND_TIMEOUT,nSent,len);
+      sendLen=0;                                          // discard any other gathered data
+      client.stop();                                      // connection is no longer usable since encrypted frames must be received in sequence
+      return(nSent);
+    }
+  }
+
+  return(nSent);
+}
+
+//////////////////////////////////////
 
-    int n=aad[0]+aad[1]*256;                // compute number of bytes expected in message after decoding
+void HAPClient::queueData(const uint8_t *buf, size_t len){
+
+  if(sendLen+len>SEND_MSS)                  // not enough room to add data
+    flushSend();
+
+  if(sendBuf==NULL)
+    sendBuf=(uint8_t *)HS_MALLOC(SEND_MSS);
+
+  if(len>SEND_MSS || sendBuf==NULL){        // data cannot be gathered - write directly to client
+    sendData(buf,len);
+    return;
+  }
 
-    if(nBytes+n>messageSize){      // exceeded maximum number of bytes allowed in plaintext message
-      LOG0("\n\n*** ERROR:  Decrypted message of %d bytes exceeded maximum expected message length of %d bytes\n\n",nBytes+n,messageSize);
+  memcpy(sendBuf+sendLen,buf,len);
+  sendLen+=len;
+}
+
+//////////////////////////////////////
+
+void HAPClient::flushSend(){
+
+  if(sendLen==0)
+    return;
+
+  size_t len=sendLen;
+  sendLen=0;
+  sendData(sendBuf,len);
+}
+
+//////////////////////////////////////
+
+void HAPClient::stopClient(){
+
+  flushSend();
+  client.stop();
+}
+
+//////////////////////////////////////
+
+void HAPClient::flushAll(){
+
+  for(int i=0;i<homeSpan.maxConnections;i++)
+    if(hap[i]->sendLen>0)
+      hap[i]->flushSend();
+}
+
+//////////////////////////////////////
+
+int HAPClient::receiveEncrypted(int nBytes){
+
+  if(rawLen==0)                                           // no encrypted data pending
+    rawStart=httpLen+1;                                   // place new data immediately after plaintext, leaving room for null character added by processRequest()
+
+  if(rawLen+nBytes>MAX_HTTP+1042)                        // read no more than maximum plaintext size plus one full frame - any remaining bytes are read on next poll
+    nBytes=MAX_HTTP+1042-rawLen;
+
+  if(!growBuffer(httpBuf,httpCap,rawStart+rawLen+nBytes))     // append new data to any encrypted bytes (i.e. partial frames) left over from prior reads
+    return(0);
+
+  if(nBytes>0 && client.read(httpBuf+rawStart+rawLen,nBytes)!=nBytes){     // read all available data with a single call
+    LOG0("\n\n*** ERROR: Malformed encrypted message frame\n\n");
+    return(0);      
+  }
+
+  rawLen+=nBytes;
+
+  while(rawLen>=2){                                       // enough bytes to read 2-byte AAD record
+
+    uint8_t *frame=httpBuf+rawStart;                      // pointer to start of next encrypted frame
+    int n=frame[0]+frame[1]*256;                          // compute number of bytes expected in frame after decoding
+
+    if(n>1024){                                           // HAP frames are limited to 1024 bytes of encrypted data
+      LOG0("\n\n*** ERROR: Malformed encrypted message frame (length of %d bytes exceeds maximum of 1024 bytes)\n\n",n);
       return(0);
-      }
+    }
+
+    if(rawLen<n+18)                                       // frame is incomplete (n bytes in encoded message + 2-byte AAD + 16-byte authentication tag) - wait for more data
+      break;
+
+    // Buffered plaintext may exceed MAX_HTTP by up to one frame, so a frame that completes a request (and perhaps starts the next pipelined request)
+    // is never held back while that request waits for it.  A frame is deferred only if more than MAX_HTTP bytes of plaintext are already buffered,
+    // in which case processRequest() always either consumes a complete message (and then calls receiveEncrypted(0) to decrypt any deferred frames)
+    // or rejects the request, so deferred frames cannot stall
 
-    TempBuffer<uint8_t> tBuf(n+16);      // expected number of total bytes = n bytes in encoded message + 16 bytes for appended authentication tag      
+    if(httpLen+n>MAX_HTTP+1024)
+      break;
 
-    if(client.read(tBuf,tBuf.len())!=tBuf.len()){      
-      LOG0("\n\n*** ERROR: Malformed encrypted message frame\n\n");
-      return(0);      
-    }                
+    // decrypt in place - authentication tag is verified before any plaintext is written
 
-    if(crypto_aead_chacha20poly1305_ietf_decrypt(httpBuf+nBytes, NULL, NULL, tBuf, tBuf.len(), aad, 2, c2aNonce.get(), c2aKey)==-1){
+    if(crypto_aead_chacha20poly1305_ietf_decrypt_detached(frame+2, NULL, frame+2, n, frame+2+n, frame, 2, c2aNonce.get(), c2aKey)==-1){
       LOG0("\n\n*** ERROR: Can't Decrypt Message\n\n");
       return(0);        
     }
 
     c2aNonce.inc();
 
-    nBytes+=n;          // increment total number of bytes in plaintext message
+    memmove(httpBuf+httpLen,frame+2,n);     // append plaintext to end of any plaintext already decrypted
+    httpLen+=n;                             // increment total number of bytes in plaintext message
+    rawStart+=n+18;                         // advance to start of next frame
+    rawLen-=n+18;
     
   } // while
 
-  return(nBytes);
+  if(rawLen>0 && rawStart!=httpLen+1){                    // shift any partial frame to follow plaintext so buffer does not continue to grow
+    memmove(httpBuf+httpLen+1,httpBuf+rawStart,rawLen);
+    rawStart=httpLen+1;
+  }
+
+  return(1);
     
 } // receiveEncrypted
 
@@ -1473,7 +1946,7 @@ void HAPClient::tearDown(uint8_t *id){
   for(int i=0;i<homeSpan.maxConnections;i++){     // loop over all connection slots
     if(hap[i]->client && (id==NULL || (hap[i]->cPair && !memcmp(id,hap[i]->cPair->ID,hap_controller_IDBYTES)))){
       LOG1("*** Terminating Client #%d\n",i);
-      hap[i]->client.stop();
+      hap[i]->stopClient();
     }
   }
 }
@@ -1557,8 +2030,7 @@ HapOut::HapStreamBuffer::HapStreamBuffer(){
   hash=(uint8_t *)heap_caps_malloc(48,caps);                                                // space for SHA-384 hash output
   ctx = (mbedtls_sha512_context *)heap_caps_malloc(sizeof(mbedtls_sha512_context),caps);    // space for hash context
   
-  mbedtls_sha512_init(ctx);                 // initialize context
-  mbedtls_sha512_starts_ret(ctx,1);         // start SHA-384 hash (note second argument=1)
+  mbedtls_sha512_init(ctx);                 // initialize context (hash is only started when enabled)
   
   setp(buffer, buffer+bufSize-1);           // assign buffer pointers
 }
@@ -1577,6 +2049,32 @@ void HapOut::HapStreamBuffer::flushBuffer(){
   
   int num=pptr()-pbase();
 
+  if(spooling){                                   // capture data in spool buffer instead of transmitting
+    if(!spoolFull && spoolLen+num>spoolCap){
+      size_t newCap=spoolCap?spoolCap*2:bufSize*2;
+      while(newCap<spoolLen+num)
+        newCap*=2;
+      if(newCap>spoolLimit)
+        newCap=spoolLimit;
+      char *newBuf=(newCap>=spoolLen+num)?(char *)HS_REALLOC(spoolBuf,newCap):NULL;
+      if(newBuf){
+        spoolBuf=newBuf;
+        spoolCap=newCap;
+      } else {                                    // spool cannot grow - discard what has been spooled and just count remaining output so caller can re-create it
+        LOG2("\n*** Spool buffer limited to %d bytes - response will be serialized twice\n\n",spoolCap);
+        spoolFull=true;
+        releaseSpool();
+      }
+    }
+    if(!spoolFull){
+      memcpy(spoolBuf+spoolLen,buffer,num);
+      spoolLen+=num;
+    }
+    byteCount+=num;
+    pbump(-num);
+    return;
+  }
+
   byteCount+=num;
 
   buffer[num]='\0';                               // add null terminator but DO NOT increment num (we don't want terminator considered as part of buffer)
@@ -1593,7 +2091,7 @@ void HapOut::HapStreamBuffer::flushBuffer(){
   
   if(hapClient!=NULL){
     if(!hapClient->cPair){                        // if not encrypted 
-      hapClient->client.write(buffer,num);        // transmit data buffer
+      hapClient->queueData((uint8_t *)buffer,num);    // transmit data buffer
       
     } else {                                      // if encrypted
       
@@ -1601,17 +2099,71 @@ void HapOut::HapStreamBuffer::flushBuffer(){
       encBuf[1]=num/256;
       crypto_aead_chacha20poly1305_ietf_encrypt(encBuf+2,NULL,(uint8_t *)buffer,num,encBuf,2,NULL,hapClient->a2cNonce.get(),hapClient->a2cKey);   // encrypt buffer with AAD prepended and authentication tag appended
       
-      hapClient->client.write(encBuf,num+18);     // transmit encrypted frame
+      hapClient->queueData(encBuf,num+18);        // transmit encrypted frame
       hapClient->a2cNonce.inc();                  // increment nonce
     }
-    delay(1);
   }
 
-  mbedtls_sha512_update_ret(ctx,(uint8_t *)buffer,num);   // update hash
+  if(hashing)
+    mbedtls_sha512_update_ret(ctx,(uint8_t *)buffer,num);   // update hash
 
   pbump(-num);                                            // reset buffer pointers
 }
 
+//////////////////////////////////////
+
+void HapOut::HapStreamBuffer::startSpool(boolean unlimited){
+
+  spooling=true;
+  spoolFull=false;
+  spoolLimit=unlimited?SIZE_MAX:spoolMax;
+}
+
+//////////////////////////////////////
+
+size_t HapOut::HapStreamBuffer::endSpool(){
+
+  flushBuffer();              // move any remaining data into spool buffer
+  spooling=false;
+  size_t nBytes=spoolFull?byteCount:spoolLen;
+  byteCount=0;
+  return(nBytes);
+}
+
+//////////////////////////////////////
+
+char *HapOut::detachSpool(size_t &len){
+
+  if(hapBuffer.spoolFull){
+    len=0;
+    return(NULL);
+  }
+
+  char *buf=hapBuffer.spoolBuf;
+  len=hapBuffer.spoolLen;
+
+  if(buf && len>0)
+    buf=(char *)HS_REALLOC(buf,len);      // shrink to fit (cannot fail)
+
+  hapBuffer.spoolBuf=NULL;
+  hapBuffer.spoolLen=0;
+  hapBuffer.spoolCap=0;
+  return(buf);
+}
+
+//////////////////////////////////////
+
+void HapOut::HapStreamBuffer::releaseSpool(){
+
+  spoolLen=0;
+
+  if(spoolCap>spoolKeep){     // free large spool buffers (small ones are kept for re-use)
+    free(spoolBuf);
+    spoolBuf=NULL;
+    spoolCap=0;
+  }
+}
+
 //////////////////////////////////////
         
 std::streambuf::int_type HapOut::HapStreamBuffer::overflow(std::streambuf::int_type c){
@@ -1643,8 +2195,10 @@ int HapOut::HapStreamBuffer::sync(){
     callBackUserData=NULL;
   }
 
-  mbedtls_sha512_finish_ret(ctx,hash);    // finish SHA-384 and store hash
-  mbedtls_sha512_starts_ret(ctx,1);       // re-start hash for next time
+  if(hashing){
+    mbedtls_sha512_finish_ret(ctx,hash);    // finish SHA-384 and store hash
+    hashing=false;
+  }
 
   return(0);
 }
@@ -1698,4 +2252,24 @@ Accessory HAPClient::accessory;
 list<Controller, Mallocator<Controller>> HAPClient::controllerList;
 SRP6A *HAPClient::srp=NULL;
 int HAPClient::conNum;
+
+const HAPClient::Route HAPClient::routes[]={
+  {"POST", "/pair-setup",      "application/pairing+tlv8", false, [](HAPClient *hc, HttpRequest &r){hc->postPairSetupURL(r.content,r.contentLength);}},      // POST PAIR-SETUP
+  {"POST", "/pair-verify",     "application/pairing+tlv8", false, [](HAPClient *hc, HttpRequest &r){hc->postPairVerifyURL(r.content,r.contentLength);}},     // POST PAIR-VERIFY
+  {"POST", "/pairings",        "application/pairing+tlv8", false, [](HAPClient *hc, HttpRequest &r){hc->postPairingsURL(r.content,r.contentLength);}},       // POST PAIRINGS
+  {"PUT",  "/characteristics", "application/hap+json",     true,  [](HAPClient *hc, HttpRequest &r){hc->putCharacteristicsURL((char *)r.content);}},         // PUT CHARACTERISTICS
+  {"PUT",  "/prepare",         "application/hap+json",     false, [](HAPClient *hc, HttpRequest &r){hc->putPrepareURL((char *)r.content);}},                 // PUT PREPARE
+  {"GET",  "/accessories",     NULL,                       false, [](HAPClient *hc, HttpRequest &r){hc->getAccessoriesURL();}},                              // GET ACCESSORIES
+  {"GET",  "/characteristics", NULL,                       false, [](HAPClient *hc, HttpRequest &r){                                                         // GET CHARACTERISTICS
+      if(!r.query){
+        hc->notFoundError();
+        LOG0("\n*** ERROR:  Bad GET request - URL not found\n\n");
+        return;
+      }
+      r.query[r.queryLen]='\0';          // null-terminate query string
+      hc->getCharacteristicsURL(r.query);
+    }},
+  {"GET",  NULL,               NULL,                       false, [](HAPClient *hc, HttpRequest &r){getStatusURL(hc,NULL,NULL);}},                           // GET STATUS - AN OPTIONAL, NON-HAP-R2 FEATURE
+  {NULL,   NULL,               NULL,                       false, NULL}                                                                                      // end of table
+};
  
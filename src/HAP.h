@@ -93,6 +93,27 @@ struct Accessory {
   uint8_t LTPK[crypto_sign_PUBLICKEYBYTES];        // Long Term Ed2519 Public Key
 };
 
+/////////////////////////////////////////////////
+// HTTP Request Structure
+// Locations of the request line components and needed headers, indexed in a single pass over the header block
+
+struct HttpRequest {
+  char *method=NULL;              // HTTP method (e.g. "GET")
+  size_t methodLen=0;
+  char *path=NULL;                // URL path, excluding any query string (e.g. "/characteristics")
+  size_t pathLen=0;
+  char *query=NULL;               // URL query string following '?' (NULL if none)
+  size_t queryLen=0;
+  char *contentType=NULL;         // value of Content-Type header (NULL if not present)
+  size_t contentTypeLen=0;
+  int contentLength=0;            // value of Content-Length header (0 if not present)
+  uint8_t *content=NULL;          // pointer to start of optional HTTP Content
+
+  boolean parse(char *header, size_t len);                    // index request line and headers in header block of len bytes; returns false if request line is malformed
+  boolean isMethod(const char *m){return(methodLen==strlen(m) && !strncmp(method,m,methodLen));}
+  boolean isPath(const char *p){return(pathLen==strlen(p) && !strncmp(path,p,pathLen));}
+};
+
 /////////////////////////////////////////////////
 // HAPClient Structure
 // Reads and Writes from each HAP Client connection
@@ -102,8 +123,12 @@ struct HAPClient {
   // common structures and data shared across all HAP Clients
 
   static const int MAX_HTTP=8096;                     // max number of bytes allowed for HTTP message
+  static const int MAX_STREAM=32768;                  // max number of bytes allowed for Content of a streamed PUT /characteristics request (which bounds memory used to store its parsed objects)
   static const int MAX_CONTROLLERS=16;                // maximum number of paired controllers (HAP requires at least 16)
   static const int MAX_ACCESSORIES=150;               // maximum number of allowed Accessories (HAP limit=150)
+  static const int SEND_TIMEOUT=2000;                 // max number of milliseconds to wait for room in socket send buffer before abandoning a write
+  static const int SEND_MSS=1460;                     // size of buffer used to gather outgoing frames into a single TCP segment
+  static const int PUT_POOL=16;                       // number of characteristic objects parsed from PUT /characteristics Content in each batch
   
   static nvs_handle hapNVS;                                         // handle for non-volatile-storage of HAP data
   static nvs_handle srpNVS;                                         // handle for non-volatile-storage of SRP data
@@ -114,6 +139,16 @@ struct HAPClient {
   static list<Controller, Mallocator<Controller>> controllerList;   // linked-list of Paired Controller IDs and ED25519 long-term public keys - permanently stored
   static int conNum;                                                // connection number - used to keep track of per-connection EV notifications
 
+  struct Route {                                                    // entry in URL routing table
+    const char *method;                                             // HTTP method
+    const char *path;                                               // URL path to match exactly (NULL=optional Web Log status URL, which is set at runtime)
+    const char *contentType;                                        // Content-Type the request must specify (NULL=any)
+    boolean streamable;                                             // true if Content that is too large to buffer may instead be streamed to handler (only PUT /characteristics)
+    void (*handler)(HAPClient *, HttpRequest &);                    // function that processes request
+  };
+
+  static const Route routes[];                                      // HAP URL routing table
+
   // individual structures and data defined for each Hap Client connection
   
   WiFiClient client;              // handle to client
@@ -133,9 +168,48 @@ struct HAPClient {
   Nonce a2cNonce;                 // encryption nonce (starts at zero at end of each Pair-Verify and increment every encryption - NOT DOCUMENTED)
   Nonce c2aNonce;                 // decryption nonce (starts at zero at end of each Pair-Verify and increment every encryption - NOT DOCUMENTED)
 
+  // Requests may arrive split across multiple TCP segments.  Bytes are therefore accumulated across calls to processRequest() until a complete request is available.
+  // The buffer is grown as needed and retained for the life of the connection so that steady-state requests do not require any heap allocation.
+  // Plaintext is stored at the start of the buffer, followed by any encrypted frames that have not yet been decrypted (which are decrypted in place).
+
+  uint8_t *httpBuf=NULL;          // receive buffer holding plaintext HTTP request assembled so far, followed by any pending encrypted data
+  size_t httpLen=0;               // number of bytes of plaintext stored at start of httpBuf
+  size_t httpCap=0;               // number of bytes allocated for httpBuf
+  size_t rawStart=0;              // offset in httpBuf of encrypted data that has not yet been decrypted (includes any partial frame)
+  size_t rawLen=0;                // number of bytes of encrypted data stored at rawStart
+
+  // Outgoing data (including encrypted frames) is gathered into sendBuf and written to the socket in MSS-sized chunks, either once the buffer is full
+  // or at the end of each poll cycle, so that a response and any subsequent EVENT notifications are transmitted in as few TCP segments as possible
+
+  uint8_t *sendBuf=NULL;          // buffer of outgoing data waiting to be written to socket (allocated with SEND_MSS bytes when first needed)
+  size_t sendLen=0;               // number of bytes stored in sendBuf
+
+  // PUT /characteristics Content is parsed in batches of up to PUT_POOL characteristic objects, which are saved (with copies of their values) until the
+  // entire request has been parsed.  Requests with Content too large to fit in httpBuf are streamed - characteristic objects are parsed as they arrive.
+  // No characteristic is loaded until the last object has been received, at which point all updates are loaded, committed, and responded to at once,
+  // so a partially-received request is never visible to update() or loop() methods, or to requests from other connections
+
+  int streamLen=0;                                  // number of bytes of Content remaining to be parsed (0=not streaming)
+  int streamLogged=0;                               // number of bytes at start of buffer, retained from previous chunk, that have already been logged
+  int putState=0;                                   // parser state: 0=initial "characteristics" tag not yet found, 1=parsing array, 2=end of array found, 3=end of request found
+  boolean putTWFail=false;                          // parser state: Timed Write has expired or has no PID
+  vector<SpanBuf, Mallocator<SpanBuf>> putObj;      // characteristic objects parsed so far (capacity is retained between requests)
+  vector<uint32_t, Mallocator<uint32_t>> putRefs;   // offset in putVals of value (followed by ev) of each object in putObj
+  vector<char, Mallocator<char>> putVals;           // null-terminated copies of value and ev strings of each object in putObj
+
+  // Event Notification subscriptions for this connection are stored as a bitset indexed by each Characteristic's dense characteristic number (SpanCharacteristic::charNum)
+
+  vector<uint32_t, Mallocator<uint32_t>> notifyBits;      // bit n is set if this connection has requested Event Notifications for Characteristic number n
+
   // define member methods
 
-  void processRequest();                                      // process HAP request  
+  void processRequest();                                      // read any available data from client and process every HAP request that has been fully received
+  void dispatchRequest(HttpRequest &req);                     // route a complete HTTP request to the appropriate URL handler
+  static boolean matchRoute(const Route &route, HttpRequest &req);    // returns true if req matches path and Content-Type of route
+  static boolean isStreamable(HttpRequest &req);                       // returns true if req matches a streamable route
+  void clearRequest();                                        // discards any partially-received request data (storage is retained for re-use)
+  void releaseBuffers();                                      // discards any partially-received request data and frees associated storage
+  boolean growBuffer(uint8_t *&buf, size_t &cap, size_t nBytes);  // ensures buf has capacity for at least nBytes; returns false if allocation fails
   int postPairSetupURL(uint8_t *content, size_t len);         // POST /pair-setup (HAP Section 5.6)
   int postPairVerifyURL(uint8_t *content, size_t len);        // POST /pair-verify (HAP Section 5.7)
   int postPairingsURL(uint8_t *content, size_t len);          // POST /pairings (HAP Sections 5.10-5.12)  
@@ -143,9 +217,20 @@ struct HAPClient {
   int getCharacteristicsURL(char *urlBuf);                    // GET /characteristics (HAP Section 6.7.4)  
   int putCharacteristicsURL(char *json);                      // PUT /characteristics (HAP Section 6.7.2)
   int putPrepareURL(char *json);                              // PUT /prepare (HAP Section 6.7.2.4)
+  void putCharacteristicsResponse(SpanBuf *pObj, int n);      // sends response to PUT /characteristics and transmits any EVENT Notifications
+  int streamCharacteristics();                                // parses and loads complete objects in streamed PUT /characteristics Content; returns number of bytes consumed, or -1 on error
+  int putCharacteristics(char *json, int len, boolean lastChunk);   // parses and saves complete objects in 'len' bytes of PUT /characteristics Content, and loads, commits and responds to request if lastChunk; returns number of bytes consumed, or -1 on error
+  void clearPut();                                            // discards all saved PUT /characteristics objects
 
   void tlvRespond(TLV8 &tlv8);                                // respond to client with HTTP OK header and all defined TLV data records
-  int receiveEncrypted(uint8_t *httpBuf, int messageSize);    // decrypt HTTP request (HAP Section 6.5)
+  size_t sendData(const uint8_t *buf, size_t len);            // writes len bytes to client, waiting only if socket send buffer is full; returns number of bytes written
+  void queueData(const uint8_t *buf, size_t len);             // adds len bytes to sendBuf, writing sendBuf to client first if there is not enough room
+  void flushSend();                                           // writes any data in sendBuf to client
+  void stopClient();                                          // writes any data in sendBuf to client and then disconnects client
+  int receiveEncrypted(int nBytes);                           // read nBytes of encrypted data (if any) and decrypt all completed frames in place (HAP Section 6.5); returns 0 on failure
+
+  void setNotify(uint16_t n, boolean flag);                                                          // sets/clears Event Notification request for Characteristic number n
+  void clearNotify(){memset(notifyBits.data(),0,notifyBits.size()*sizeof(uint32_t));}               // clears all Event Notification requests for this connection
 
   int notFoundError();           // return 404 error
   int badRequestError();         // return 400 error
@@ -165,6 +250,7 @@ struct HAPClient {
   static void printControllers(int minLogLevel=0);                                     // prints IDs of all allocated (paired) Controller, subject to specified minimum log level
   static void saveControllers();                                                       // saves Controller list in NVS
   static int nAdminControllers();                                                      // returns number of admin Controller
+  static void flushAll();                                                         // writes any data gathered in sendBuf for all connections
   static void tearDown(uint8_t *id);                                                   // tears down connections using Controller with ID=id; tears down all connections if id=NULL
   static void checkNotifications();                                                    // checks for Event Notifications and reports to controllers as needed (HAP Section 6.8)
   static void checkTimedWrites();                                                      // checks for expired Timed Write PIDs, and clears any found (HAP Section 6.7.2.4)
@@ -198,10 +284,27 @@ class HapOut : public std::ostream {
     size_t indent=0;
     uint8_t *hash;
     mbedtls_sha512_context *ctx;
+    boolean hashing=false;                // true if SHA-384 hash of output is being computed
     void (*callBack)(const char *, void *)=NULL;
     void *callBackUserData = NULL;
+
+    const size_t spoolKeep=4096;          // spool buffers no larger than this are retained for re-use
+#if defined(BOARD_HAS_PSRAM)
+    const size_t spoolMax=SIZE_MAX;
+#else
+    const size_t spoolMax=8192;           // without PSRAM, larger responses are not spooled in internal RAM, but are instead serialized twice
+#endif
+    boolean spooling=false;               // true if output is being captured in spool buffer instead of being transmitted
+    boolean spoolFull=false;              // true if spool buffer could not hold all output (which is then only counted)
+    size_t spoolLimit=0;                  // maximum size of spool buffer
+    char *spoolBuf=NULL;
+    size_t spoolLen=0;
+    size_t spoolCap=0;
   
     void flushBuffer();
+    void startSpool(boolean unlimited);
+    size_t endSpool();
+    void releaseSpool();
     int_type overflow(int_type c) override;
     int sync() override; 
     size_t getSize(){return(byteCount+pptr()-pbase());}
@@ -224,7 +327,15 @@ class HapOut : public std::ostream {
   HapOut& setCallback(void(*f)(const char *, void *)){hapBuffer.callBack=f;return(*this);}
   HapOut& setCallbackUserData(void *userData){hapBuffer.callBackUserData=userData;return(*this);}
   
-  uint8_t *getHash(){return(hapBuffer.hash);}
+  HapOut& spool(boolean unlimited=false){hapBuffer.startSpool(unlimited);return(*this);}    // capture all subsequent output in spool buffer instead of transmitting it (limited to spoolMax bytes unless unlimited=true)
+  size_t endSpool(){return(hapBuffer.endSpool());}                        // stop capturing output and return number of bytes output (whether or not all could be spooled)
+  boolean isSpooled(){return(!hapBuffer.spoolFull);}                      // returns true if all output was captured by last spool, else caller must re-create output instead of calling writeSpool()
+  char *detachSpool(size_t &len);                                         // returns spooled bytes (setting len), which caller must free; returns NULL if output could not be spooled
+  HapOut& writeSpool(boolean release=true){write(hapBuffer.spoolBuf,hapBuffer.spoolLen);if(release)hapBuffer.releaseSpool();return(*this);}    // output spooled bytes (e.g. after writing HTTP header with Content-Length); set release=false to output the same bytes again
+  HapOut& releaseSpool(){hapBuffer.releaseSpool();return(*this);}        // discard spooled bytes
+  
+  HapOut& enableHash(){hapBuffer.hashing=true;mbedtls_sha512_starts_ret(hapBuffer.ctx,1);return(*this);}    // compute SHA-384 hash of all subsequent output (until next flush)
+  uint8_t *getHash(){return(hapBuffer.hash);}                             // returns SHA-384 hash computed from output produced after last call to enableHash()
   size_t getSize(){return(hapBuffer.getSize());}
 };
 
@@ -71,6 +71,9 @@ void Span::begin(Category catID, const char *displayName, const char *hostNameBa
 
   if(requestedMaxCon<maxConnections)                          // if specific request for max connections is less than computed max connections
     maxConnections=requestedMaxCon;                           // over-ride max connections with requested value
+
+  if(maxConnections>32)                                       // Event Notification subscribers for each Characteristic are tracked as a 32-bit mask
+    maxConnections=32;
     
   hap=(HAPClient **)HS_CALLOC(maxConnections,sizeof(HAPClient *));
   for(int i=0;i<maxConnections;i++)
@@ -244,7 +247,7 @@ void Span::pollTask() {
       LOG1(" sec) ");
       LOG1(hap[freeSlot]->client.remoteIP());
       LOG1("\n");
-      hap[freeSlot]->client.stop();                     // disconnect client from first slot and re-use
+      hap[freeSlot]->stopClient();                       // transmit any gathered data and disconnect client, exactly as for any other server-side disconnect (buffers are released below when slot is re-used)
     }
 
     hap[freeSlot]->client=newClient;             // copy new client handle into free slot
@@ -264,6 +267,7 @@ void Span::pollTask() {
     LOG2("\n");
 
     hap[freeSlot]->cPair=NULL;                   // reset pointer to verified ID
+    hap[freeSlot]->releaseBuffers();            // discard any partial request and free buffers left over from prior connection in this slot
     homeSpan.clearNotify(freeSlot);             // clear all notification requests for this connection
     HAPClient::pairStatus=pairState_M1;         // reset starting PAIR STATE (which may be needed if Accessory failed in middle of pair-setup)
   }
@@ -278,6 +282,7 @@ void Span::pollTask() {
       homeSpan.lastClientIP="0.0.0.0";                              // reset stored IP address to show "0.0.0.0" if homeSpan.getClientIP() is used in any other context
       
       if(!hap[i]->client){                                 // client disconnected by server
+        hap[i]->releaseBuffers();                          // free request buffers associated with this connection
         LOG1("** Disconnected Client #");
         LOG1(i);
         LOG1("  (");
@@ -287,9 +292,15 @@ void Span::pollTask() {
 
       LOG2("\n");
 
+    } else if(!hap[i]->client && (hap[i]->httpBuf || hap[i]->sendBuf)){     // client disconnected by controller - free buffers now rather than when slot is re-used
+      if(hap[i]->streamLen>0)
+        LOG1("** Client #%d disconnected while streaming request\n",i);
+      hap[i]->releaseBuffers();                             // discard any partial request and free request and send buffers
     } // process HAP Client 
   } // for-loop over connection slots
 
+  HAPClient::flushAll();                                 // transmit all responses gathered above before calling any user-defined loop() methods
+
   snapTime=millis();                                     // snap the current time for use in ALL loop routines
   
   for(auto it=Loops.begin();it!=Loops.end();it++)                 // call loop() for all Services with over-ridden loop() methods
@@ -300,6 +311,7 @@ void Span::pollTask() {
     
   HAPClient::checkNotifications();  
   HAPClient::checkTimedWrites();
+  HAPClient::flushAll();                                 // transmit any EVENT notifications
 
   if(spanOTA.enabled)
     ArduinoOTA.handle();
@@ -319,6 +331,9 @@ void Span::pollTask() {
 
   statusLED->check();
 
+  if(!nvsQueue.dirty.empty() && millis()-nvsQueue.dirtyTime>=nvsQueue.interval)     // save any deferred Characteristic values
+    flushValues();
+
   if(rebootCallback && snapTime>rebootCallbackTime){
     rebootCallback(rebootCount-1);
     rebootCount=0;
@@ -767,6 +782,7 @@ void Span::processSerialCommand(const char *c){
 
     case 'V': {
       
+      discardValues();
       nvs_erase_all(charNVS);
       nvs_commit(charNVS);      
       LOG0("\n*** Values for all saved Characteristics erased!\n\n");
@@ -794,6 +810,7 @@ void Span::processSerialCommand(const char *c){
       nvs_commit(HAPClient::hapNVS);      
       nvs_erase_all(wifiNVS);
       nvs_commit(wifiNVS);   
+      discardValues();                  // deferred Characteristic values are discarded, rather than saved, since all Characteristic data is being erased
       nvs_erase_all(charNVS);
       nvs_commit(charNVS);
       nvs_erase_all(otaNVS);
@@ -806,6 +823,7 @@ void Span::processSerialCommand(const char *c){
 
     case 'E': {
       
+      discardValues();                  // deferred Characteristic values are discarded, rather than saved by reboot(), since all NVS data is being erased
       nvs_flash_erase();
       LOG0("\n*** ALL DATA ERASED!  Restarting...\n\n");
       reboot();
@@ -847,7 +865,8 @@ void Span::processSerialCommand(const char *c){
       LOG0("Lowest stack level: %d bytes (%s)\n",uxTaskGetStackHighWaterMark(loopTaskHandle),pcTaskGetName(loopTaskHandle));
       nvs_stats_t nvs_stats;
       nvs_get_stats(NULL, &nvs_stats);
-      LOG0("NVS Flash Partition: %d of %d records used\n\n",nvs_stats.used_entries,nvs_stats.total_entries-126);      
+      LOG0("NVS Flash Partition: %d of %d records used\n",nvs_stats.used_entries,nvs_stats.total_entries-126);
+      LOG0("NVS Characteristic Writes: %u deferred, %u coalesced, %u committed, %d pending\n\n",nvsQueue.deferred,nvsQueue.coalesced,nvsQueue.committed,nvsQueue.dirty.size());
     }
     break;       
 
@@ -1179,6 +1198,7 @@ void Span::resetStatus(){
 ///////////////////////////////
 
 void Span::reboot(){
+  flushValues();
   STATUS_UPDATE(off(),HS_REBOOTING)
   delay(1000);
   ESP.restart();  
@@ -1277,6 +1297,125 @@ void Span::printfAttributes(int flags){
 
 ///////////////////////////////
 
+boolean Span::loadAccessoriesCache(){
+
+  if(!accessoriesCache.enabled)
+    return(false);
+
+  if(accessoriesCache.text && !memcmp(accessoriesCache.hashCode,hapConfig.hashCode,48))    // cache is available and was built from current database
+    return(true);
+
+  accessoriesCache.clear();
+  
+  hapOut.spool(true);
+  printfAttributes(GET_VALUE|GET_META|GET_PERMS|GET_TYPE|GET_DESC|GET_CACHE);   // record location of each value (which are not printed) in accessoriesCache.splices
+  hapOut.endSpool();
+  accessoriesCache.text=hapOut.detachSpool(accessoriesCache.len);
+
+  if(!accessoriesCache.text){
+    LOG0("\n*** WARNING:  Insufficient memory to cache GET /accessories response - caching disabled\n\n");
+    accessoriesCache.clear();
+    accessoriesCache.enabled=false;
+    return(false);
+  }
+
+  memcpy(accessoriesCache.hashCode,hapConfig.hashCode,48);
+
+  LOG1("Cached GET /accessories response: %d bytes with %d values\n",accessoriesCache.len,accessoriesCache.splices.size());
+
+  return(accessoriesCache.text!=NULL);
+}
+
+///////////////////////////////
+
+void Span::printfCachedAttributes(){
+
+  size_t offset=0;
+
+  for(auto it=accessoriesCache.splices.begin();it!=accessoriesCache.splices.end();it++){
+    hapOut.write(accessoriesCache.text+offset,it->offset-offset);                        // write cached text up to location of next value...
+    it->characteristic->uvWrite(it->characteristic->value);                               // ...followed by current value
+    offset=it->offset;
+  }
+
+  hapOut.write(accessoriesCache.text+offset,accessoriesCache.len-offset);
+}
+
+///////////////////////////////
+
+size_t Span::sizeCachedAttributes(){
+
+  size_t nBytes=accessoriesCache.len;
+
+  for(auto it=accessoriesCache.splices.begin();it!=accessoriesCache.splices.end();it++)
+    nBytes+=it->characteristic->uvLength(it->characteristic->value);
+
+  return(nBytes);
+}
+
+///////////////////////////////
+
+static uint32_t hashText(const char *text){          // FNV-1a hash
+
+  uint32_t hash=2166136261UL;
+  while(*text)
+    hash=(hash^(uint8_t)(*text++))*16777619UL;
+  return(hash);
+}
+
+///////////////////////////////
+
+const char *SpanFragments::intern(const char *text){
+
+  uint32_t hash=hashText(text);
+  auto range=pool.equal_range(hash);
+
+  for(auto it=range.first;it!=range.second;it++){
+    if(!strcmp(it->second.text,text)){            // fragment already in pool
+      it->second.refCount++;
+      return(it->second.text);
+    }
+  }
+
+  char *copy=(char *)HS_MALLOC(strlen(text)+1);
+  strcpy(copy,text);
+  pool.insert({hash,{copy,1}});
+  return(copy);
+}
+
+///////////////////////////////
+
+void SpanFragments::release(const char *text){
+
+  if(!text)
+    return;
+
+  auto range=pool.equal_range(hashText(text));
+
+  for(auto it=range.first;it!=range.second;it++){
+    if(it->second.text==text){
+      if(--it->second.refCount==0){               // fragment is no longer used
+        free(it->second.text);
+        pool.erase(it);
+      }
+      return;
+    }
+  }
+}
+
+///////////////////////////////
+
+void SpanCache::clear(){
+
+  free(text);
+  text=NULL;
+  len=0;
+  splices.clear();
+  splices.shrink_to_fit();
+}
+
+///////////////////////////////
+
 boolean Span::deleteAccessory(uint32_t n){
   
   auto it=homeSpan.Accessories.begin();
@@ -1293,112 +1432,343 @@ boolean Span::deleteAccessory(uint32_t n){
 
 SpanCharacteristic *Span::find(uint32_t aid, int iid){
 
-  int index=-1;
-  for(int i=0;i<Accessories.size();i++){   // loop over all Accessories to find aid
-    if(Accessories[i]->aid==aid){          // if match, save index into Accessories array
-      index=i;
-      break;
+  if(aidIndex.empty())         // rebuild index if needed
+    buildIndex();
+
+  auto acc=std::lower_bound(aidIndex.begin(),aidIndex.end(),aid,[](SpanAccessory *a, uint32_t aid){return(a->aid<aid);});    // binary search for aid
+
+  if(acc==aidIndex.end() || (*acc)->aid!=aid)      // fail if no match on aid
+    return(NULL);
+
+  if(iid<1 || iid>(*acc)->iidIndex.size())          // fail if iid out of range
+    return(NULL);
+
+  return((*acc)->iidIndex[iid-1]);                  // return pointer to Characteristic (which is NULL if iid is not a Characteristic)
+}
+
+///////////////////////////////
+
+void Span::buildIndex(){
+
+  aidIndex.assign(Accessories.begin(),Accessories.end());
+  std::stable_sort(aidIndex.begin(),aidIndex.end(),[](SpanAccessory *a, SpanAccessory *b){return(a->aid<b->aid);});   // stable sort so duplicate aids resolve to first Accessory, as with a linear search
+
+  for(auto acc=Accessories.begin(); acc!=Accessories.end(); acc++){
+    (*acc)->iidIndex.assign((*acc)->iidCount,NULL);
+    for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+      for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+        if((*chr)->iid>=1 && (*chr)->iid<=(*acc)->iidCount)
+          (*acc)->iidIndex[(*chr)->iid-1]=*chr;
+      }
+    }
+  }
+}
+
+///////////////////////////////
+
+// Helper functions for the PUT /characteristics JSON tokenizer.  All operate on a buffer bounded by 'end' that need not be null-terminated
+
+static char *skipSpace(char *p, char *end){
+
+  while(p<end && (*p==' ' || *p=='\t' || *p=='\n' || *p=='\r'))
+    p++;
+  return(p);
+}
+
+static char *findObjectEnd(char *p, char *end, int depth=0){       // returns pointer to '}' that closes the JSON object starting at 'p' (or, if depth=1, the object that 'p' is already inside), or NULL if object is not yet complete
+
+  for(;p<end;p++){
+    if(*p=='"'){                                          // skip over quoted strings, including any escaped characters, so braces within strings are ignored
+      for(p++;p<end && *p!='"';p++)
+        if(*p=='\\')
+          p++;
+      if(p>=end)
+        return(NULL);
     }
+    else if(*p=='{' || *p=='[')
+      depth++;
+    else if((*p=='}' || *p==']') && --depth==0)
+      return(p);
   }
 
-  if(index<0)                  // fail if no match on aid
+  return(NULL);
+}
+
+static char *parseHex4(char *p, char *end, uint32_t &code){
+
+  if(end-p<4)
     return(NULL);
-    
-  for(int i=0;i<Accessories[index]->Services.size();i++){                           // loop over all Services in this Accessory
-    for(int j=0;j<Accessories[index]->Services[i]->Characteristics.size();j++){     // loop over all Characteristics in this Service
-      
-      if(iid == Accessories[index]->Services[i]->Characteristics[j]->iid)           // if matching iid
-        return(Accessories[index]->Services[i]->Characteristics[j]);                // return pointer to Characteristic
+
+  code=0;
+  for(int i=0;i<4;i++,p++){
+    code<<=4;
+    if(*p>='0' && *p<='9')
+      code|=*p-'0';
+    else if(*p>='a' && *p<='f')
+      code|=*p-'a'+10;
+    else if(*p>='A' && *p<='F')
+      code|=*p-'A'+10;
+    else
+      return(NULL);
+  }
+
+  return(p);
+}
+
+static char *parseString(char *p, char *end){           // decodes the JSON string starting at opening quote 'p' in place (as a null-terminated string starting at p+1); returns pointer past closing quote, or NULL if invalid
+
+  char *w=++p;                                           // decoded characters are never longer than their escape sequences, so string can be decoded in place
+
+  while(p<end && *p!='"'){
+
+    if((uint8_t)*p<0x20)                                 // control characters must be escaped
+      return(NULL);
+
+    if(*p!='\\'){
+      *w++=*p++;
+      continue;
+    }
+
+    if(++p==end)
+      return(NULL);
+
+    switch(*p++){
+      case '"': *w++='"'; break;
+      case '\\': *w++='\\'; break;
+      case '/': *w++='/'; break;
+      case 'b': *w++='\b'; break;
+      case 'f': *w++='\f'; break;
+      case 'n': *w++='\n'; break;
+      case 'r': *w++='\r'; break;
+      case 't': *w++='\t'; break;
+
+      case 'u': {
+        uint32_t code, low;
+        if(!(p=parseHex4(p,end,code)))
+          return(NULL);
+        if(code>=0xDC00 && code<=0xDFFF)                                // unpaired low surrogate
+          return(NULL);
+        if(code>=0xD800 && code<=0xDBFF){                               // high surrogate must be followed by escaped low surrogate
+          if(end-p<2 || p[0]!='\\' || p[1]!='u' || !(p=parseHex4(p+2,end,low)) || low<0xDC00 || low>0xDFFF)
+            return(NULL);
+          code=0x10000+((code-0xD800)<<10)+(low-0xDC00);
+        }
+        if(code<0x80){                                                  // encode as UTF-8
+          *w++=code;
+        } else if(code<0x800){
+          *w++=0xC0|(code>>6);
+          *w++=0x80|(code&0x3F);
+        } else if(code<0x10000){
+          *w++=0xE0|(code>>12);
+          *w++=0x80|((code>>6)&0x3F);
+          *w++=0x80|(code&0x3F);
+        } else {
+          *w++=0xF0|(code>>18);
+          *w++=0x80|((code>>12)&0x3F);
+          *w++=0x80|((code>>6)&0x3F);
+          *w++=0x80|(code&0x3F);
+        }
+      }
+      break;
+
+      default:
+        return(NULL);
     }
   }
 
-  return(NULL);                // fail if no match on iid
+  if(p==end)
+    return(NULL);
+
+  *w='\0';
+  return(p+1);
 }
 
-///////////////////////////////
+static char *parseMember(char *q, char *e, char *&name, char *&val){    // parses "name":value member starting at 'q' in object ending at 'e', null-terminating name and value in place; returns pointer past member and any following comma, or NULL on error
 
-int Span::countCharacteristics(char *buf){
+  name=q+1;
+  if(*q!='"' || !(q=parseString(q,e)) || (q=skipSpace(q,e))==e || *q!=':' || (q=skipSpace(q+1,e))==e){
+    LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - malformed property\n\n");
+    return(NULL);
+  }
 
-  int nObj=0;
-  
-  const char tag[]="\"aid\"";
-  while((buf=strstr(buf,tag))){         // count number of characteristic objects in PUT JSON request
-    nObj++;
-    buf+=strlen(tag);
+  val=q;
+  boolean quoted=(*q=='"');
+
+  if(quoted){
+    val++;
+    q=parseString(q,e);
+  } else if(*q!='{' && *q!='['){
+    while(q<e && *q!=',' && *q!=' ' && *q!='\t' && *q!='\n' && *q!='\r')
+      q++;
+    if(q==val)                                                  // empty value
+      q=NULL;
+  } else {
+    q=NULL;                                                     // nested objects and arrays are not used in PUT /characteristics requests
   }
 
-  return(nObj);
+  char *next=q?skipSpace(q,e):NULL;
+  if(!next || (next<e && *next!=',')){
+    LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - malformed value for property \"%s\"\n\n",name);
+    return(NULL);
+  }
+
+  if(!quoted)
+    *q='\0';                                                    // null-terminate unquoted value in place (which may overwrite closing brace of object)
+
+  return((next<e)?next+1:e);
 }
 
 ///////////////////////////////
 
-int Span::updateCharacteristics(char *buf, SpanBuf *pObj){
+int Span::parseCharacteristics(char *&buf, char *end, SpanBuf *pObj, int maxObj, int &state, boolean &twFail){
 
   int nObj=0;
-  char *p1;
-  int cFound=0;
-  boolean twFail=false;
-  
-  while(char *t1=strtok_r(buf,"{",&p1)){           // parse 'buf' and extract objects into 'pObj' unless NULL
-   buf=NULL;
-    char *p2;
-    int okay=0;
-    
-    while(char *t2=strtok_r(t1,"}[]:, \"\t\n\r",&p2)){
+  char *p=buf;
 
-      if(!cFound){                                 // first token found
-        if(strcmp(t2,"characteristics")){
-          LOG0("\n*** ERROR:  Problems parsing JSON - initial \"characteristics\" tag not found\n\n");
-          return(0);
-        }
-        cFound=1;
+  auto checkPID=[this,&twFail](char *val){                          // checks Timed Write PID
+    uint64_t pid=strtoull(val,NULL,0);
+    if(!TimedWrites.count(pid)){
+      LOG0("\n*** ERROR:  Timed Write PID not found\n\n");
+      twFail=true;
+    } else
+    if(millis()>TimedWrites[pid]){
+      LOG0("\n*** ERROR:  Timed Write Expired\n\n");
+      twFail=true;
+    }
+  };
+
+  if(state==0){                                                     // initial {"characteristics":[ not yet found
+    p=skipSpace(p,end);
+    char *b=(char *)memchr(p,'[',end-p);
+    if(!b)
+      return(0);                                                    // wait for more data
+
+    const char tag[]="\"characteristics\"";
+    int tagLen=strlen(tag);
+
+    if(*p=='{')
+      p=skipSpace(p+1,b);
+    if(b-p>=tagLen && !strncmp(p,tag,tagLen))
+      p=skipSpace(p+tagLen,b);
+    if(p<b && *p==':')
+      p=skipSpace(p+1,b);
+
+    if(p!=b){
+      LOG0("\n*** ERROR:  Problems parsing JSON - initial \"characteristics\" tag not found\n\n");
+      return(-1);
+    }
+
+    state=1;
+    buf=p=b+1;
+  }
+
+  while(state==1 && nObj<maxObj){                                   // parse each complete characteristic object in array
+
+    p=skipSpace(p,end);
+    if(p==end)
+      break;
+
+    if(*p==','){
+      p++;
+      continue;
+    }
+
+    if(*p==']'){                                                    // end of characteristics array
+      state=2;
+      buf=++p;
+      break;
+    }
+
+    char *e;
+    if(*p!='{' || !(e=findObjectEnd(p,end))){
+      if(*p=='{')                                                   // object is not yet complete - wait for more data
         break;
-      }
-      
-      t1=NULL;
-      char *t3;
-      if(!strcmp(t2,"aid") && (t3=strtok_r(t1,"}[]:, \"\t\n\r",&p2))){
-        sscanf(t3,"%u",&pObj[nObj].aid);
+      LOG0("\n*** ERROR:  Problems parsing JSON - characteristics array contains non-object element\n\n");
+      return(-1);
+    }
+
+    SpanBuf &obj=pObj[nObj];
+    obj=SpanBuf();
+    int okay=0;
+    char *q=p+1;
+    char *name, *val;
+
+    while((q=skipSpace(q,e))<e){                                    // parse each "property":value pair in object
+
+      if(!(q=parseMember(q,e,name,val)))
+        return(-1);
+
+      if(!strcmp(name,"aid")){
+        obj.aid=strtoul(val,NULL,10);
         okay|=1;
-      } else 
-      if(!strcmp(t2,"iid") && (t3=strtok_r(t1,"}[]:, \"\t\n\r",&p2))){
-        pObj[nObj].iid=atoi(t3);
+      } else
+      if(!strcmp(name,"iid")){
+        obj.iid=atoi(val);
         okay|=2;
-      } else 
-      if(!strcmp(t2,"value") && (t3=strtok_r(t1,"}[]:,\"",&p2))){
-        pObj[nObj].val=t3;
+      } else
+      if(!strcmp(name,"value")){
+        obj.val=val;
         okay|=4;
-      } else 
-      if(!strcmp(t2,"ev") && (t3=strtok_r(t1,"}[]:, \"\t\n\r",&p2))){
-        pObj[nObj].ev=t3;
+      } else
+      if(!strcmp(name,"ev")){
+        obj.ev=val;
         okay|=8;
-      } else 
-      if(!strcmp(t2,"pid") && (t3=strtok_r(t1,"}[]:, \"\t\n\r",&p2))){        
-        uint64_t pid=strtoull(t3,NULL,0);        
-        if(!TimedWrites.count(pid)){
-          LOG0("\n*** ERROR:  Timed Write PID not found\n\n");
-          twFail=true;
-        } else        
-        if(millis()>TimedWrites[pid]){
-          LOG0("\n*** ERROR:  Timed Write Expired\n\n");
-          twFail=true;
-        }        
+      } else
+      if(!strcmp(name,"pid")){
+        checkPID(val);
       } else {
-        LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - unexpected property \"%s\"\n\n",t2);
-        return(0);
+        LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - unexpected property \"%s\"\n\n",name);
+        return(-1);
       }
-    } // parse property tokens
+    } // parse properties
 
-    if(!t1){                                                                  // at least one token was found that was not initial "characteristics"
-      if(okay==7 || okay==11  || okay==15){                                   // all required properties found                           
-        nObj++;                                                               // increment number of characteristic objects found        
+    if(okay!=7 && okay!=11 && okay!=15){                            // all required properties must be found
+      LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - missing required properties\n\n");
+      return(-1);
+    }
+
+    nObj++;
+    buf=p=e+1;
+  } // parse objects
+
+  if(state==1 && p==end)                                            // consume any trailing whitespace, but retain start of any incomplete object
+    buf=p;
+
+  if(state==2){                                                     // parse remaining members of request following characteristics array, of which only "pid" is allowed
+    char *e=findObjectEnd(p,end,1);
+    if(!e)
+      return(nObj);                                                 // request is not yet complete - wait for more data
+
+    char *q=p;
+    char *name, *val;
+
+    while((q=skipSpace(q,e))<e){
+      if(*q==','){
+        q++;
+        continue;
+      }
+
+      if(!(q=parseMember(q,e,name,val)))
+        return(-1);
+
+      if(!strcmp(name,"pid")){
+        checkPID(val);
       } else {
-        LOG0("\n*** ERROR:  Problems parsing JSON characteristics object - missing required properties\n\n");
-        return(0);
+        LOG0("\n*** ERROR:  Problems parsing JSON - unexpected property \"%s\" in characteristics request\n\n",name);
+        return(-1);
       }
     }
-      
-  } // parse objects
+
+    state=3;                                                        // request is complete (any remaining Content is ignored)
+    buf=e+1;
+  }
+
+  return(nObj);
+}
+
+///////////////////////////////
+
+void Span::loadCharacteristics(SpanBuf *pObj, int nObj, boolean twFail){
 
   snapTime=millis();                                           // timestamp for this series of updates, assigned to each characteristic in loadUpdate()
 
@@ -1417,55 +1787,411 @@ int Span::updateCharacteristics(char *buf, SpanBuf *pObj){
     }
       
   } // first pass
+}
+
+///////////////////////////////
+
+void Span::commitCharacteristics(SpanBuf *pObj, int nObj){
+
+  boolean nvsWritten=false;                                    // set if any values were written to NVS immediately, which are then committed together once all objects are processed
       
   for(int i=0;i<nObj;i++){                                     // PASS 2: loop again over all objects       
-    if(pObj[i].status==StatusCode::TBD){                       // if object status still TBD
+    if(pObj[i].status!=StatusCode::TBD)                        // skip objects that failed in PASS 1 (including those with no matching characteristic)
+      continue;
 
-      StatusCode status=pObj[i].characteristic->service->update()?StatusCode::OK:StatusCode::Unable;                  // update service and save statusCode as OK or Unable depending on whether return is true or false
+    SpanService *svc=pObj[i].characteristic->service;
 
-      for(int j=i;j<nObj;j++){                                                      // loop over this object plus any remaining objects to update values and save status for any other characteristics in this service
-        
-        if(pObj[j].characteristic->service==pObj[i].characteristic->service){       // if service of this characteristic matches service that was updated
-          pObj[j].status=status;                                                    // save statusCode for this object
-          LOG1("Updating aid=");
-          LOG1(pObj[j].characteristic->aid);
-          LOG1(" iid=");  
-          LOG1(pObj[j].characteristic->iid);
-          if(status==StatusCode::OK){                                                     // if status is okay
-            pObj[j].characteristic->uvSet(pObj[j].characteristic->value,pObj[j].characteristic->newValue);               // update characteristic value with new value
-            if(pObj[j].characteristic->nvsKey){                                                                                               // if storage key found
-              if(pObj[j].characteristic->format!=FORMAT::STRING && pObj[j].characteristic->format!=FORMAT::DATA)
-                nvs_set_u64(charNVS,pObj[j].characteristic->nvsKey,pObj[j].characteristic->value.UINT64);  // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-              else
-                nvs_set_str(charNVS,pObj[j].characteristic->nvsKey,pObj[j].characteristic->value.STRING);                                     // store data
-              nvs_commit(charNVS);
-            }
-            LOG1(" (okay)\n");
-          } else {                                                                        // if status not okay
-            pObj[j].characteristic->uvSet(pObj[j].characteristic->newValue,pObj[j].characteristic->value);                // replace characteristic new value with original value
-            LOG1(" (failed)\n");
-          }
-          pObj[j].characteristic->isUpdated=false;             // reset isUpdated flag for characteristic
+    if(pObj[i].characteristic->isUpdated){                     // first object found for this service - update service and commit all of its updated characteristics in a single sweep
+
+      svc->updateStatus=svc->update()?StatusCode::OK:StatusCode::Unable;              // update service and save statusCode as OK or Unable depending on whether return is true or false
+
+      for(auto chr : svc->Characteristics){
+        if(!chr->isUpdated)
+          continue;
+          
+        LOG1("Updating aid=");
+        LOG1(chr->aid);
+        LOG1(" iid=");  
+        LOG1(chr->iid);
+        if(svc->updateStatus==StatusCode::OK){                                        // if status is okay
+          chr->uvSet(chr->value,chr->newValue);                                       // update characteristic value with new value
+          if(chr->nvsKey)                                                             // if storage key found
+            nvsWritten|=saveValue(chr,false);
+          LOG1(" (okay)\n");
+        } else {                                                                      // if status not okay
+          chr->uvSet(chr->newValue,chr->value);                                       // replace characteristic new value with original value
+          LOG1(" (failed)\n");
         }
+        chr->isUpdated=false;                                                         // reset isUpdated flag for characteristic
       }
+    }
 
-    } // object had TBD status
+    pObj[i].status=svc->updateStatus;                          // save statusCode for this object (which is also correct for any duplicate objects that referenced the same characteristic)
   } // loop over all objects
-      
-  return(1);
+
+  if(nvsWritten)
+    nvs_commit(charNVS);                                       // commit all values saved by this request at once
+}
+
+///////////////////////////////
+
+boolean Span::saveValue(SpanCharacteristic *chr, boolean commit){
+
+  if(chr->nvsDurable || nvsQueue.interval==0){                 // save immediately (any deferred copy of this value is simply re-written when queue is flushed)
+    writeValue(chr);
+    if(commit)
+      nvs_commit(charNVS);
+    nvsQueue.committed++;
+    return(true);
+  }
+
+  if(chr->nvsDirty){                                           // value is already queued - the new value will be written in its place
+    nvsQueue.coalesced++;
+    return(false);
+  }
+
+  queueValue(chr);
+  return(false);
+}
+
+///////////////////////////////
+
+void Span::queueValue(SpanCharacteristic *chr){
+
+  if(chr->nvsDirty)
+    return;
+
+  if(nvsQueue.dirty.empty())
+    nvsQueue.dirtyTime=millis();
+
+  chr->nvsDirty=true;
+  nvsQueue.dirty.push_back(chr);
+  nvsQueue.deferred++;
+}
+
+///////////////////////////////
+
+void Span::writeValue(SpanCharacteristic *chr){
+
+  if(packedNVS)
+    writeBlob(chr->service->accessory);
+  else if(chr->format!=FORMAT::STRING && chr->format!=FORMAT::DATA)
+    nvs_set_u64(charNVS,chr->nvsKey,chr->value.UINT64);        // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
+  else
+    nvs_set_str(charNVS,chr->nvsKey,chr->value.STRING);        // store string data
+}
+
+///////////////////////////////
+
+void Span::flushValues(){
+
+  if(nvsQueue.dirty.empty())
+    return;
+
+  for(auto chr : nvsQueue.dirty){
+    if(packedNVS)
+      chr->service->accessory->nvsDirty=true;         // write each packed blob only once, below
+    else
+      writeValue(chr);
+    chr->nvsDirty=false;
+    nvsQueue.committed++;
+  }
+
+  for(auto chr : nvsQueue.dirty){
+    if(packedNVS && chr->service->accessory->nvsDirty){
+      writeBlob(chr->service->accessory);
+      chr->service->accessory->nvsDirty=false;
+    }
+  }
+
+  nvs_commit(charNVS);                                         // commit all values at once
+  nvsQueue.dirty.clear();
+
+  LOG2("Saved deferred Characteristic values in NVS\n");
+}
+
+///////////////////////////////
+
+// Packed NVS blobs (one per Accessory, with key "ACC" followed by the aid in hex) contain a sequence of records, one per stored Characteristic in order of iid,
+// followed by any records kept for Characteristics that have not (yet) been created.  Each record is an 8-byte header (see blobRecord_t) followed by the value,
+// which is either 8 bytes (the uint64_t representation of a numeric value) or the characters of a string value (without a terminating null)
+
+struct blobRecord_t {
+  uint16_t iid;                   // iid of Characteristic
+  uint16_t len;                   // length of value that follows header
+  uint32_t type;                  // FNV-1a hash of Characteristic type (so that full 128-bit UUIDs of custom Characteristics are distinguished)
+};
+
+boolean Span::isStored(SpanAccessory *acc, int iid, uint32_t type){
+
+  for(auto svc : acc->Services){
+    for(auto chr : svc->Characteristics){
+      if(chr->nvsKey && chr->iid==iid && hashText(chr->type)==type)
+        return(true);
+    }
+  }
+
+  return(false);
+}
+
+boolean Span::restoreValue(SpanCharacteristic *chr){
+
+  boolean numeric=(chr->format!=FORMAT::STRING && chr->format!=FORMAT::DATA);
+
+  if(packedNVS){
+    SpanAccessory *acc=chr->service->accessory;
+    if(!acc->nvsLoaded)
+      loadBlob(acc);
+
+    uint32_t type=hashText(chr->type);
+    size_t start=acc->nvsCursor;
+    size_t offset=start;
+    boolean wrapped=false;
+
+    while(!wrapped || offset<start){              // search records starting at cursor, since Characteristics are usually created in the same order their records were written
+      if(acc->nvsBlobLen-offset<sizeof(blobRecord_t)){
+        if(wrapped)
+          break;
+        offset=0;
+        wrapped=true;
+        continue;
+      }
+
+      blobRecord_t rec;
+      memcpy(&rec,acc->nvsBlob+offset,sizeof(rec));
+      uint8_t *val=acc->nvsBlob+offset+sizeof(rec);
+      if(rec.len>acc->nvsBlobLen-offset-sizeof(rec))     // corrupt record
+        break;
+      offset+=sizeof(rec)+rec.len;
+
+      if(rec.iid!=chr->iid || rec.type!=type)
+        continue;
+
+      acc->nvsCursor=offset;
+
+      if(numeric){
+        if(rec.len!=8)                            // format has changed
+          break;
+        memcpy(&chr->value.UINT64,val,8);
+      } else {
+        chr->value.STRING=(char *)HS_REALLOC(chr->value.STRING,rec.len+1);
+        memcpy(chr->value.STRING,val,rec.len);
+        chr->value.STRING[rec.len]='\0';
+      }
+      return(true);
+    }
+  }
+
+  size_t len;
+  boolean found=false;
+
+  if(numeric){
+    found=(nvs_get_u64(charNVS,chr->nvsKey,&(chr->value.UINT64))==ESP_OK);
+  } else if(!nvs_get_str(charNVS,chr->nvsKey,NULL,&len)){
+    chr->value.STRING=(char *)HS_REALLOC(chr->value.STRING,len);
+    nvs_get_str(charNVS,chr->nvsKey,chr->value.STRING,&len);
+    found=true;
+  }
+
+  if(found && packedNVS){                         // migrate value into packed blob
+    chr->nvsLegacy=true;
+    queueValue(chr);
+  }
+
+  return(found);
+}
+
+///////////////////////////////
+
+void Span::loadBlob(SpanAccessory *acc){
+
+  char key[16];
+  size_t len;
+
+  sprintf(key,"ACC%08X",acc->aid);
+  acc->nvsLoaded=true;
+
+  if(nvs_get_blob(charNVS,key,NULL,&len)!=ESP_OK || len==0)
+    return;
+
+  acc->nvsBlob=(uint8_t *)HS_MALLOC(len);
+  nvs_get_blob(charNVS,key,acc->nvsBlob,&len);
+  acc->nvsBlobLen=len;
+  acc->nvsCursor=0;
+}
+
+///////////////////////////////
+
+void Span::writeBlob(SpanAccessory *acc){
+
+  char key[16];
+  sprintf(key,"ACC%08X",acc->aid);
+
+  size_t oldLen;                                                  // read current blob, so records for any Characteristics not (yet) created are kept (even once blob read at startup has been released)
+  if(nvs_get_blob(charNVS,key,NULL,&oldLen)!=ESP_OK)
+    oldLen=0;
+  TempBuffer<uint8_t> old(oldLen+1);
+  if(oldLen>0)
+    nvs_get_blob(charNVS,key,old,&oldLen);
+
+  size_t len=0;
+
+  for(auto svc : acc->Services){                                  // compute size of blob
+    for(auto chr : svc->Characteristics){
+      if(chr->nvsKey)
+        len+=sizeof(blobRecord_t)+((chr->format!=FORMAT::STRING && chr->format!=FORMAT::DATA)?8:(chr->value.STRING?strlen(chr->value.STRING):0));
+    }
+  }
+
+  blobRecord_t rec;
+
+  for(size_t offset=0;oldLen-offset>=sizeof(rec);){               // add size of existing records for any Characteristics that do not currently exist
+    memcpy(&rec,old+offset,sizeof(rec));
+    if(rec.len>oldLen-offset-sizeof(rec))                         // corrupt record
+      break;
+    if(!isStored(acc,rec.iid,rec.type))
+      len+=sizeof(rec)+rec.len;
+    offset+=sizeof(rec)+rec.len;
+  }
+
+  TempBuffer<uint8_t> blob(len+1);
+  uint8_t *p=blob;
+
+  for(auto svc : acc->Services){
+    for(auto chr : svc->Characteristics){
+      if(!chr->nvsKey)
+        continue;
+      rec={(uint16_t)chr->iid,8,hashText(chr->type)};
+      const void *val=&chr->value.UINT64;
+      if(chr->format==FORMAT::STRING || chr->format==FORMAT::DATA){
+        rec.len=chr->value.STRING?strlen(chr->value.STRING):0;
+        val=chr->value.STRING;
+      }
+      memcpy(p,&rec,sizeof(rec));
+      memcpy(p+sizeof(rec),val,rec.len);
+      p+=sizeof(rec)+rec.len;
+    }
+  }
+
+  for(size_t offset=0;oldLen-offset>=sizeof(rec);){               // keep existing records for any Characteristics that do not currently exist
+    memcpy(&rec,old+offset,sizeof(rec));
+    if(rec.len>oldLen-offset-sizeof(rec))
+      break;
+    if(!isStored(acc,rec.iid,rec.type)){
+      memcpy(p,old+offset,sizeof(rec)+rec.len);
+      p+=sizeof(rec)+rec.len;
+    }
+    offset+=sizeof(rec)+rec.len;
+  }
+
+  nvs_set_blob(charNVS,key,blob,p-blob.get());
+
+  for(auto svc : acc->Services){                                  // erase individual NVS entries of any values migrated into blob
+    for(auto chr : svc->Characteristics){
+      if(chr->nvsLegacy){
+        nvs_erase_key(charNVS,chr->nvsKey);
+        chr->nvsLegacy=false;
+      }
+    }
+  }
+}
+
+///////////////////////////////
+
+void Span::releaseBlobs(){
+
+  for(auto acc : Accessories){
+    free(acc->nvsBlob);
+    acc->nvsBlob=NULL;
+    acc->nvsBlobLen=0;
+    acc->nvsLoaded=false;
+  }
+}
+
+///////////////////////////////
+
+void Span::discardValues(){
+
+  for(auto chr : nvsQueue.dirty)
+    chr->nvsDirty=false;
+
+  nvsQueue.dirty.clear();
 }
 
 ///////////////////////////////
 
 void Span::clearNotify(int slotNum){
+
+  auto &bits=hap[slotNum]->notifyBits;
   
-  for(int i=0;i<Accessories.size();i++){
-    for(int j=0;j<Accessories[i]->Services.size();j++){
-      for(int k=0;k<Accessories[i]->Services[j]->Characteristics.size();k++){
-        Accessories[i]->Services[j]->Characteristics[k]->ev[slotNum]=false;
-      }
+  for(int i=0;i<bits.size();i++){                 // remove slotNum from subscriber mask of every Characteristic this connection subscribed to
+    for(uint32_t b=bits[i];b;b&=b-1)
+      charTable[i*32+__builtin_ctz(b)]->subscribers&=~(1UL<<slotNum);
+  }
+
+  hap[slotNum]->clearNotify();
+}
+
+///////////////////////////////
+
+int Span::prepareNotifications(){
+
+  uint32_t now=millis();
+
+  auto it=std::stable_partition(Notifications.begin(),Notifications.end(),[now](SpanBuf &sb){      // move Notifications that are due to front, preserving order of setVal() calls within both groups
+    SpanNotifyPolicy *p=sb.characteristic->notifyPolicy;
+    return(!p || !p->interval || !p->lastTime || now-p->lastTime>=p->interval);
+  });
+
+  return(it-Notifications.begin());
+}
+
+///////////////////////////////
+
+void Span::clearNotifications(int nObj){
+
+  uint32_t now=millis();
+
+  for(int i=0;i<nObj;i++){
+    SpanCharacteristic *chr=Notifications[i].characteristic;
+    chr->notifyPending=false;
+    if(chr->notifyPolicy){                                       // record time and value of this Notification
+      chr->notifyPolicy->lastTime=now?now:1;
+      chr->notifyPolicy->lastValue=chr->uvGet<double>(chr->value);
     }
   }
+
+  Notifications.erase(Notifications.begin(),Notifications.begin()+nObj);
+}
+
+///////////////////////////////
+
+uint32_t Span::getSubscribers(SpanBuf *pObj, int nObj){
+
+  uint32_t mask=0;
+
+  for(int i=0;i<nObj;i++){
+    if(pObj[i].status==StatusCode::OK && pObj[i].val)           // characteristic was successfully updated with a new value (i.e. not just an EV request)
+      mask|=pObj[i].characteristic->subscribers;
+  }
+
+  return(mask);
+}
+
+///////////////////////////////
+
+uint32_t Span::getSubscriberGroup(SpanBuf *pObj, int nObj, int conNum, uint32_t mask){
+
+  mask|=(1UL<<conNum);
+
+  for(int i=0;i<nObj && mask!=(1UL<<conNum);i++){
+    if(pObj[i].status==StatusCode::OK && pObj[i].val){           // characteristic was successfully updated with a new value (i.e. not just an EV request)
+      uint32_t s=pObj[i].characteristic->subscribers;
+      mask&=((s>>conNum)&1)?s:~s;                                // keep only connections that match conNum for this characteristic
+    }
+  }
+
+  return(mask);
 }
 
 ///////////////////////////////
@@ -1478,7 +2204,7 @@ void Span::printfNotify(SpanBuf *pObj, int nObj, int conNum){
     
     if(pObj[i].status==StatusCode::OK && pObj[i].val){           // characteristic was successfully updated with a new value (i.e. not just an EV request)
       
-      if(pObj[i].characteristic->ev[conNum]){                    // if notifications requested for this characteristic by specified connection number
+      if(pObj[i].characteristic->subscribers&(1UL<<conNum)){     // if notifications requested for this characteristic by specified connection number
 
         if(!notifyFlag)                                          // this is first notification for any characteristic
           hapOut << "{\"characteristics\":[";                    // print start of JSON array
@@ -1562,9 +2288,15 @@ boolean Span::printfAttributes(char **ids, int numIDs, int flags){
 
 boolean Span::updateDatabase(boolean updateMDNS){
 
-  printfAttributes(GET_META|GET_PERMS|GET_TYPE|GET_DESC);   // stream attributes database, which automtically produces a SHA-384 hash
+  hapOut.enableHash();                                       // hash output so changes to the database can be detected
+  printfAttributes(GET_META|GET_PERMS|GET_TYPE|GET_DESC);   // stream attributes database, which produces a SHA-384 hash (and precompiles JSON of every Service and Characteristic)
   hapOut.flush();  
 
+  accessoriesCache.clear();                                  // invalidate cached GET /accessories response
+  releaseBlobs();                                            // all stored Characteristic values have been restored
+  buildIndex();                                              // rebuild aid/iid lookup index
+  Notifications.reserve(charTable.size());                   // each Characteristic is queued at most once, so Notifications never needs to grow in setVal()
+
   boolean changed=false;
 
   if(memcmp(hapOut.getHash(),hapConfig.hashCode,48)){       // if hash code of current HAP database does not match stored hash code
@@ -1626,6 +2358,7 @@ SpanAccessory::SpanAccessory(uint32_t aid){
     this->aid=aid;
   }
 
+  homeSpan.structureChanged();
 }
 
 ///////////////////////////////
@@ -1639,6 +2372,8 @@ SpanAccessory::~SpanAccessory(){
   while((*acc)!=this)
     acc++;
   homeSpan.Accessories.erase(acc);
+  homeSpan.structureChanged();
+  free(nvsBlob);
   LOG1("Deleted Accessory AID=%d\n",aid);
 }
 
@@ -1676,6 +2411,7 @@ SpanService::SpanService(const char *type, const char *hapName, boolean isCustom
   homeSpan.Accessories.back()->Services.push_back(this);  
   accessory=homeSpan.Accessories.back();
   iid=++(homeSpan.Accessories.back()->iidCount);
+  homeSpan.structureChanged();
 }
 
 ///////////////////////////////
@@ -1689,6 +2425,8 @@ SpanService::~SpanService(){
   while((*svc)!=this)
     svc++;
   accessory->Services.erase(svc);
+  homeSpan.structureChanged();
+  homeSpan.jsonFragments.release(headerJSON);
 
   for(svc=homeSpan.Loops.begin(); svc!=homeSpan.Loops.end() && (*svc)!=this; svc++);    // search for entry in Loop vector...
   if(svc!=homeSpan.Loops.end()){                                                        // ...if it exists, erase it
@@ -1714,6 +2452,7 @@ SpanService::~SpanService(){
 
 SpanService *SpanService::setPrimary(){
   primary=true;
+  invalidateHeader();
   return(this);
 }
 
@@ -1721,6 +2460,7 @@ SpanService *SpanService::setPrimary(){
 
 SpanService *SpanService::setHidden(){
   hidden=true;
+  invalidateHeader();
   return(this);
 }
 
@@ -1728,32 +2468,49 @@ SpanService *SpanService::setHidden(){
 
 SpanService *SpanService::addLink(SpanService *svc){
   linkedServices.push_back(svc);
+  invalidateHeader();
   return(this);
 }
 
 ///////////////////////////////
 
-void SpanService::printfAttributes(int flags){
+void SpanService::compileHeader(){
 
-  hapOut << "{\"iid\":" << iid << ",\"type\":\"" << type << "\",";
+  String s="{\"iid\":";
+  s+=iid;
+  s+=",\"type\":\"";
+  s+=type;
+  s+="\",";
   
   if(hidden)
-    hapOut << "\"hidden\":true,";
+    s+="\"hidden\":true,";
     
   if(primary)
-    hapOut << "\"primary\":true,";
+    s+="\"primary\":true,";
 
   if(!linkedServices.empty()){
-    hapOut << "\"linked\":[";
+    s+="\"linked\":[";
     for(int i=0;i<linkedServices.size();i++){
-      hapOut << linkedServices[i]->iid;
+      s+=linkedServices[i]->iid;
       if(i+1<linkedServices.size())
-        hapOut << ",";
+        s+=",";
     }
-     hapOut << "],";
+    s+="],";
   }
     
-  hapOut << "\"characteristics\":[";
+  s+="\"characteristics\":[";
+
+  headerJSON=homeSpan.jsonFragments.intern(s.c_str());
+}
+
+///////////////////////////////
+
+void SpanService::printfAttributes(int flags){
+
+  if(!headerJSON)
+    compileHeader();
+
+  hapOut << headerJSON;
   
   for(int i=0;i<Characteristics.size();i++){
     Characteristics[i]->printfAttributes(flags);    
@@ -1789,7 +2546,25 @@ SpanCharacteristic::SpanCharacteristic(HapChar *hapChar, boolean isCustom){
   service=homeSpan.Accessories.back()->Services.back();
   aid=homeSpan.Accessories.back()->aid;
 
-  ev=(boolean *)HS_CALLOC(homeSpan.maxConnections,sizeof(boolean));
+  for(charNum=homeSpan.charFree;charNum<homeSpan.charTable.size() && homeSpan.charTable[charNum];charNum++);     // find first free characteristic number (without re-scanning entries known to be in use)
+  if(charNum==homeSpan.charTable.size())
+    homeSpan.charTable.push_back(this);
+  else
+    homeSpan.charTable[charNum]=this;
+  homeSpan.charFree=charNum+1;
+  homeSpan.structureChanged();
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::setNotify(int conNum, boolean flag){
+
+  hap[conNum]->setNotify(charNum,flag);       // per-connection bitset (used to clear all requests when connection slot is re-used)
+  
+  if(flag)                                    // per-characteristic mask (used to find subscribers when notifications are sent)
+    subscribers|=(1UL<<conNum);
+  else
+    subscribers&=~(1UL<<conNum);
 }
 
 ///////////////////////////////
@@ -1800,12 +2575,34 @@ SpanCharacteristic::~SpanCharacteristic(){
   while((*chr)!=this)
     chr++;
   service->Characteristics.erase(chr);
+  homeSpan.structureChanged();
+
+  if(notifyPending){                                      // remove any pending Notification for this Characteristic
+    auto &n=homeSpan.Notifications;
+    n.erase(std::remove_if(n.begin(),n.end(),[this](SpanBuf &sb){return(sb.characteristic==this);}),n.end());
+  }
+
+  if(nvsDirty){                                           // save any deferred NVS value for this Characteristic and remove it from queue
+    auto &d=homeSpan.nvsQueue.dirty;
+    homeSpan.writeValue(this);
+    nvs_commit(homeSpan.charNVS);
+    homeSpan.nvsQueue.committed++;
+    d.erase(std::remove(d.begin(),d.end(),this),d.end());
+  }
+
+  homeSpan.charTable[charNum]=NULL;                       // release characteristic number...
+  for(int i=0;subscribers;i++,subscribers>>=1)            // ...and clear any Event Notification requests for it so it can be safely re-used
+    if(subscribers&1)
+      hap[i]->setNotify(charNum,false);
+  if(charNum<homeSpan.charFree)                           // next Characteristic created re-uses lowest free number
+    homeSpan.charFree=charNum;
 
-  free(ev);
   free(desc);
   free(unit);
   free(validValues);
   free(nvsKey);
+  homeSpan.jsonFragments.release(attrJSON);
+  delete notifyPolicy;
 
   if(format==FORMAT::STRING || format==FORMAT::DATA){
     free(value.STRING);
@@ -1817,11 +2614,136 @@ SpanCharacteristic::~SpanCharacteristic(){
 
 ///////////////////////////////
 
-void SpanCharacteristic::printfAttributes(int flags){
+static size_t truncLen(const char *s){             // returns length of s truncated to 64 bytes...
+
+  size_t len=strnlen(s,65);
+
+  if(len>64){
+    len=64;
+    while(len>0 && (s[len]&0xC0)==0x80)             // ...without splitting a multi-byte UTF-8 character
+      len--;
+  }
+
+  return(len);
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::uvWrite(UVal &u){
+
+  if(format!=FORMAT::STRING && format!=FORMAT::DATA){
+    char c[24];
+    hapOut.write(c,uvFormat(u,c));
+    return;
+  }
+
+  const char *s=u.STRING?u.STRING:"";
+  size_t len=truncLen(s);
+
+  hapOut << "\"";
+
+  size_t run=0;                                     // start of current run of characters that do not need escaping
+  for(size_t i=0;i<len;i++){
+    uint8_t x=s[i];
+    if(x>=0x20 && x!='"' && x!='\\')
+      continue;
+    hapOut.write(s+run,i-run);
+    run=i+1;
+    switch(x){
+      case '"': hapOut << "\\\""; break;
+      case '\\': hapOut << "\\\\"; break;
+      case '\b': hapOut << "\\b"; break;
+      case '\f': hapOut << "\\f"; break;
+      case '\n': hapOut << "\\n"; break;
+      case '\r': hapOut << "\\r"; break;
+      case '\t': hapOut << "\\t"; break;
+      default:
+        char c[7]={'\\','u','0','0',"0123456789abcdef"[x>>4],"0123456789abcdef"[x&0xF],'\0'};
+        hapOut << c;
+    }
+  }
+
+  hapOut.write(s+run,len-run);
+  hapOut << "\"";
+}
+
+///////////////////////////////
+
+size_t SpanCharacteristic::uvLength(UVal &u){
+
+  if(format!=FORMAT::STRING && format!=FORMAT::DATA){
+    char c[24];
+    return(uvFormat(u,c));
+  }
+
+  const char *s=u.STRING?u.STRING:"";
+  size_t len=truncLen(s);
+  size_t nBytes=len+2;                              // string plus surrounding quotes
+
+  for(size_t i=0;i<len;i++){                        // add extra bytes for each escaped character (must match uvWrite)
+    uint8_t x=s[i];
+    if(x=='"' || x=='\\' || x=='\b' || x=='\f' || x=='\n' || x=='\r' || x=='\t')
+      nBytes++;
+    else if(x<0x20)
+      nBytes+=5;
+  }
+
+  return(nBytes);
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::compileAttributes(){
 
   const char permCodes[][7]={"pr","pw","ev","aa","tw","hd","wr"};
   const char formatCodes[][9]={"bool","uint8","uint16","uint32","uint64","int","float","string","data"};
 
+  String s=",\"format\":\"";                 // segment 1: metadata
+  s+=formatCodes[format];
+  s+="\"";
+    
+  if(customRange){
+    s+=",\"minValue\":" + uvPrint(minValue) + ",\"maxValue\":" + uvPrint(maxValue);
+      
+    if(uvGet<float>(stepValue)>0)
+      s+=",\"minStep\":" + uvPrint(stepValue);
+  }
+
+  if(unit){
+    if(strlen(unit)>0)
+      s+=",\"unit\":\"" + String(unit) + "\"";
+    else
+      s+=",\"unit\":null";
+  }
+
+  if(validValues)
+    s+=",\"valid-values\":" + String(validValues);
+
+  descOffset=s.length();                    // segment 2: description
+    
+  if(desc)
+    s+=",\"description\":\"" + String(desc) + "\"";
+
+  permsOffset=s.length();                   // segment 3: permissions
+  
+  s+=",\"perms\":[";
+  for(int i=0;i<7;i++){
+    if(perms&(1<<i)){
+      s+="\"" + String(permCodes[i]) + "\"";
+      if(perms>=(1<<(i+1)))
+        s+=",";
+    }
+  }
+  s+="]";
+
+  attrLen=s.length();
+  attrJSON=homeSpan.jsonFragments.intern(s.c_str());
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::printfAttributes(int flags){
+
   hapOut << "{\"iid\":" << iid;
 
   if(flags&GET_TYPE)
@@ -1830,53 +2752,41 @@ void SpanCharacteristic::printfAttributes(int flags){
   if((perms&PR) && (flags&GET_VALUE)){    
     if(perms&NV && !(flags&GET_NV))
       hapOut << ",\"value\":null";
-    else
-      hapOut << ",\"value\":" << uvPrint(value).c_str();
-  }
-
-  if(flags&GET_META){
-    hapOut << ",\"format\":\"" << formatCodes[format] << "\"";
-    
-    if(customRange && (flags&GET_META)){
-      hapOut << ",\"minValue\":" << uvPrint(minValue).c_str() << ",\"maxValue\":" << uvPrint(maxValue).c_str();
-        
-      if(uvGet<float>(stepValue)>0)
-        hapOut << ",\"minStep\":" << uvPrint(stepValue).c_str();
+    else if(flags&GET_CACHE){
+      hapOut << ",\"value\":";
+      homeSpan.accessoriesCache.splices.push_back({hapOut.getSize(),this});     // value is inserted here when cached response is transmitted
     }
-
-    if(unit){
-      if(strlen(unit)>0)
-        hapOut << ",\"unit\":\"" << unit << "\"";
-     else
-        hapOut << ",\"unit\":null";
-    }
-
-    if(validValues){
-      hapOut << ",\"valid-values\":" << validValues;
+    else {
+      hapOut << ",\"value\":";
+      uvWrite(value);
     }
   }
-    
-  if(desc && (flags&GET_DESC)){
-    hapOut << ",\"description\":\"" << desc << "\"";
-  }
 
-  if(flags&GET_PERMS){
-    hapOut << ",\"perms\":[";
-    for(int i=0;i<7;i++){
-      if(perms&(1<<i)){
-        hapOut << "\"" << permCodes[i] <<"\"";
-        if(perms>=(1<<(i+1)))
-          hapOut << ",";
+  if(flags&(GET_META|GET_DESC|GET_PERMS)){
+    if(!attrJSON)
+      compileAttributes();
+
+    const int segFlags[3]={GET_META,GET_DESC,GET_PERMS};
+    const size_t segOffset[4]={0,descOffset,permsOffset,attrLen};
+
+    for(int i=0;i<3;){                      // write each contiguous run of requested segments with a single write
+      if(!(flags&segFlags[i])){
+        i++;
+        continue;
       }
+      int j=i+1;
+      while(j<3 && (flags&segFlags[j]))
+        j++;
+      hapOut.write(attrJSON+segOffset[i],segOffset[j]-segOffset[i]);
+      i=j;
     }
-    hapOut << "]";
   }
 
   if(flags&GET_AID)
     hapOut << ",\"aid\":" << aid;
   
   if(flags&GET_EV)
-    hapOut << ",\"ev\":" << (ev[HAPClient::conNum]?"true":"false");
+    hapOut << ",\"ev\":" << ((subscribers&(1UL<<HAPClient::conNum))?"true":"false");
 
   if(flags&GET_STATUS)
     hapOut << ",\"status\":0";    
@@ -1886,16 +2796,16 @@ void SpanCharacteristic::printfAttributes(int flags){
 
 ///////////////////////////////
 
+template <typename T> static boolean inRange(T val, T min, T max, T step){     // returns true if val is within [min,max] and (if step>0) is a whole number of steps from min
+  return(val>=min && val<=max && (step<=0 || (val-min)%step==0));
+}
+
 StatusCode SpanCharacteristic::loadUpdate(char *val, char *ev){
 
   if(ev){                // request for notification
     boolean evFlag;
     
-    if(!strcmp(ev,"0") || !strcmp(ev,"false"))
-      evFlag=false;
-    else if(!strcmp(ev,"1") || !strcmp(ev,"true"))
-      evFlag=true;
-    else
+    if(!Utils::parseBool(ev,evFlag))
       return(StatusCode::InvalidValue);
     
     if(evFlag && !(perms&EV))         // notification is not supported for characteristic
@@ -1908,7 +2818,7 @@ StatusCode SpanCharacteristic::loadUpdate(char *val, char *ev){
     LOG1(": ");
     LOG1(evFlag?"true":"false");
     LOG1("\n");
-    this->ev[HAPClient::conNum]=evFlag;
+    setNotify(HAPClient::conNum,evFlag);
   }
 
   if(!val)                // no request to update value
@@ -1917,65 +2827,53 @@ StatusCode SpanCharacteristic::loadUpdate(char *val, char *ev){
   if(!(perms&PW))         // cannot write to read only characteristic
     return(StatusCode::ReadOnly);
 
+  uint64_t u;                                       // values are parsed by format, and integer values must be within range and on a step boundary
+  int64_t n;
+  double x;
+
   switch(format){
     
     case BOOL:
-      if(!strcmp(val,"0") || !strcmp(val,"false"))
-        newValue.BOOL=false;
-      else if(!strcmp(val,"1") || !strcmp(val,"true"))
-        newValue.BOOL=true;
-      else
+      if(!Utils::parseBool(val,newValue.BOOL))
         return(StatusCode::InvalidValue);
       break;
 
     case INT:
-      if(!strcmp(val,"false"))
-        newValue.INT=0;
-      else if(!strcmp(val,"true"))
-        newValue.INT=1;
-      else if(!sscanf(val,"%d",&newValue.INT))
+      if(!Utils::parseInt(val,INT32_MIN,INT32_MAX,n) || !inRange<int64_t>(n,minValue.INT,maxValue.INT,stepValue.INT))
         return(StatusCode::InvalidValue);
+      newValue.INT=n;
       break;
 
     case UINT8:
-      if(!strcmp(val,"false"))
-        newValue.UINT8=0;
-      else if(!strcmp(val,"true"))
-        newValue.UINT8=1;
-      else if(!sscanf(val,"%hhu",&newValue.UINT8))
+      if(!Utils::parseUInt(val,UINT8_MAX,u) || !inRange<uint64_t>(u,minValue.UINT8,maxValue.UINT8,stepValue.UINT8))
         return(StatusCode::InvalidValue);
+      newValue.UINT8=u;
       break;
             
     case UINT16:
-      if(!strcmp(val,"false"))
-        newValue.UINT16=0;
-      else if(!strcmp(val,"true"))
-        newValue.UINT16=1;
-      else if(!sscanf(val,"%hu",&newValue.UINT16))
+      if(!Utils::parseUInt(val,UINT16_MAX,u) || !inRange<uint64_t>(u,minValue.UINT16,maxValue.UINT16,stepValue.UINT16))
         return(StatusCode::InvalidValue);
+      newValue.UINT16=u;
       break;
       
     case UINT32:
-      if(!strcmp(val,"false"))
-        newValue.UINT32=0;
-      else if(!strcmp(val,"true"))
-        newValue.UINT32=1;
-      else if(!sscanf(val,"%u",&newValue.UINT32))
+      if(!Utils::parseUInt(val,UINT32_MAX,u) || !inRange<uint64_t>(u,minValue.UINT32,maxValue.UINT32,stepValue.UINT32))
         return(StatusCode::InvalidValue);
+      newValue.UINT32=u;
       break;
       
     case UINT64:
-      if(!strcmp(val,"false"))
-        newValue.UINT64=0;
-      else if(!strcmp(val,"true"))
-        newValue.UINT64=1;
-      else if(!sscanf(val,"%llu",&newValue.UINT64))
+      if(!Utils::parseUInt(val,UINT64_MAX,u) || !inRange<uint64_t>(u,minValue.UINT64,maxValue.UINT64,stepValue.UINT64))
         return(StatusCode::InvalidValue);
+      newValue.UINT64=u;
       break;
 
     case FLOAT:
-      if(!sscanf(val,"%lg",&newValue.FLOAT))
+      if(!Utils::parseFloat(val,x) || x<minValue.FLOAT || x>maxValue.FLOAT)
         return(StatusCode::InvalidValue);
+      if(stepValue.FLOAT>0)                     // float values are rounded to the nearest step, rather than rejected, since controllers may write values converted from other units (e.g. Fahrenheit)
+        x=fmin(minValue.FLOAT+round((x-minValue.FLOAT)/stepValue.FLOAT)*stepValue.FLOAT,maxValue.FLOAT);
+      newValue.FLOAT=x;
       break;
 
     case STRING:
@@ -2032,6 +2930,7 @@ SpanCharacteristic *SpanCharacteristic::setValidValues(int n, ...){
 
   validValues=(char *)HS_REALLOC(validValues, strlen(s.c_str()) + 1);
   strcpy(validValues,s.c_str());
+  invalidateAttributes();
 
   return(this);
 }
@@ -2214,6 +3113,7 @@ void SpanOTA::start(){
   LOG0("\n*** Current Partition: %s\n*** New Partition: %s\n*** OTA Starting..",
     esp_ota_get_running_partition()->label,esp_ota_get_next_update_partition(NULL)->label);
   otaPercent=0;
+  homeSpan.flushValues();                     // save any deferred Characteristic values before OTA update begins
   STATUS_UPDATE(start(LED_OTA_STARTED),HS_OTA_STARTED)
 }
 
@@ -69,7 +69,8 @@ enum {
   GET_DESC=32,
   GET_NV=64,
   GET_VALUE=128,
-  GET_STATUS=256
+  GET_STATUS=256,
+  GET_CACHE=512
 };
 
 ///////////////////////////////
@@ -191,6 +192,56 @@ struct SpanOTA{                               // manages OTA process
 //   USER API CLASSES BEGINS HERE   //
 //////////////////////////////////////
 
+struct SpanCache{                             // cached GET /accessories response (with the value of each Characteristic spliced in when transmitted)
+
+  struct splice_t {
+    size_t offset;                            // offset in text at which Characteristic value is inserted
+    SpanCharacteristic *characteristic;       // Characteristic whose value is inserted
+  };
+
+  char *text=NULL;                            // JSON of HAP attribute database with all Characteristic values removed (stored in PSRAM when available)
+  size_t len=0;                               // length of text
+  vector<splice_t, Mallocator<splice_t>> splices;     // locations at which Characteristic values are inserted, in order of increasing offset
+  uint8_t hashCode[48];                       // SHA-384 hash of HAP attribute database when cache was built
+
+#if defined(BOARD_HAS_PSRAM)
+  boolean enabled=true;                       // cache is enabled by default only when PSRAM is available
+#else
+  boolean enabled=false;
+#endif
+
+  void clear();                               // invalidates cache and frees associated storage
+};
+
+///////////////////////////////
+
+struct SpanFragments{                         // pool of precompiled JSON fragments, interned so identical fragments (such as those of identical Accessories in a bridge) are stored only once
+
+  struct fragment_t {
+    char *text;                               // null-terminated fragment (stored in PSRAM when available)
+    uint32_t refCount;                        // number of Services and Characteristics sharing fragment
+  };
+
+  std::unordered_multimap<uint32_t, fragment_t> pool;     // fragments keyed on hash of text
+
+  const char *intern(const char *text);       // returns shared copy of text, adding it to pool if not already present
+  void release(const char *text);             // releases shared copy of text returned by intern(), freeing it once no longer used
+};
+
+///////////////////////////////
+
+struct SpanNVSQueue{                           // write-behind queue of Characteristic values waiting to be saved in NVS
+
+  vector<SpanCharacteristic *, Mallocator<SpanCharacteristic *>> dirty;     // Characteristics with values not yet written to NVS (in order of first change)
+  uint32_t interval=2000;                     // maximum time (in ms) a changed value is deferred before being written to NVS (0=write immediately)
+  unsigned long dirtyTime=0;                  // time at which oldest deferred value was queued
+  uint32_t deferred=0;                        // number of values queued for a deferred write
+  uint32_t coalesced=0;                       // number of changes merged into a value that was already queued
+  uint32_t committed=0;                       // number of values written and committed to NVS
+};
+
+///////////////////////////////
+
 class Span{
 
   friend class SpanAccessory;
@@ -258,9 +309,16 @@ class Span{
     
   SpanOTA spanOTA;                                  // manages OTA process
   SpanConfig hapConfig;                             // track configuration changes to the HAP Accessory database; used to increment the configuration number (c#) when changes found
+  SpanCache accessoriesCache;                       // optional cache of GET /accessories response
+  SpanFragments jsonFragments;                      // precompiled JSON fragments of Services and Characteristics
+  SpanNVSQueue nvsQueue;                            // Characteristic values waiting to be saved in NVS
+  boolean packedNVS=false;                          // if true, Characteristic values are saved in a single packed NVS blob per Accessory, rather than a separate NVS entry per Characteristic
+  vector<SpanAccessory *, Mallocator<SpanAccessory *>> aidIndex;      // Accessories sorted by aid, for use by find() (empty if index needs to be rebuilt)
+  vector<SpanCharacteristic *, Mallocator<SpanCharacteristic *>> charTable;     // all Characteristics, indexed by SpanCharacteristic::charNum (NULL entries are free for re-use)
+  uint16_t charFree=0;                                                          // lowest characteristic number that may be free (all lower entries in charTable are in use)
   vector<SpanAccessory *, Mallocator<SpanAccessory *>> Accessories;              // vector of pointers to all Accessories
   vector<SpanService *, Mallocator<SpanService *>> Loops;                      // vector of pointer to all Services that have over-ridden loop() methods
-  vector<SpanBuf, Mallocator<SpanBuf>> Notifications;                    // vector of SpanBuf objects that store info for Characteristics that are updated with setVal() and require a Notification Event
+  vector<SpanBuf, Mallocator<SpanBuf>> Notifications;                    // vector of SpanBuf objects that store info for Characteristics that are updated with setVal() and require a Notification Event (at most one per Characteristic)
   vector<SpanButton *,  Mallocator<SpanButton *>> PushButtons;                 // vector of pointer to all PushButtons
   unordered_map<uint64_t, uint32_t> TimedWrites;    // map of timed-write PIDs and Alarm Times (based on TTLs)
   
@@ -273,14 +331,33 @@ class Span{
   void resetStatus();                           // resets statusLED and calls statusCallback based on current HomeSpan status
 
   void printfAttributes(int flags=GET_VALUE|GET_META|GET_PERMS|GET_TYPE|GET_DESC);   // writes Attributes JSON database to hapOut stream
+  boolean loadAccessoriesCache();                                         // builds accessoriesCache if needed; returns true if cache is enabled and available
+  void printfCachedAttributes();                                          // writes Attributes JSON database to hapOut stream using accessoriesCache
+  size_t sizeCachedAttributes();                                          // returns number of bytes printfCachedAttributes() writes, without serializing any output
   
   SpanCharacteristic *find(uint32_t aid, int iid);                        // return Characteristic with matching aid and iid (else NULL if not found)
-  int countCharacteristics(char *buf);                                    // return number of characteristic objects referenced in PUT /characteristics JSON request
-  int updateCharacteristics(char *buf, SpanBuf *pObj);                    // parses PUT /characteristics JSON request 'buf into 'pObj' and updates referenced characteristics; returns 1 on success, 0 on fail
+  void buildIndex();                                                      // builds aidIndex, and iidIndex of every Accessory, for use by find()
+  void structureChanged(){aidIndex.clear();accessoriesCache.clear();}    // invalidates lookup index and cached GET /accessories response (called whenever Accessories, Services, or Characteristics are added or deleted)
+  int parseCharacteristics(char *&buf, char *end, SpanBuf *pObj, int maxObj, int &state, boolean &twFail);   // parses up to maxObj complete objects of PUT /characteristics JSON request from 'buf' to 'end' into 'pObj' (with parser state/twFail, including any trailing Timed Write pid), decoding strings in place and advancing 'buf' past all parsed Content; returns number of objects, or -1 on fail
+  void loadCharacteristics(SpanBuf *pObj, int nObj, boolean twFail);     // PASS 1: finds characteristics referenced in 'pObj' and loads their new values
+  void commitCharacteristics(SpanBuf *pObj, int nObj);                    // PASS 2: updates each service of characteristics loaded in PASS 1 once, and saves new values (or restores original values if update failed)
   void printfAttributes(SpanBuf *pObj, int nObj);                         // writes SpanBuf objects to hapOut stream
   boolean printfAttributes(char **ids, int numIDs, int flags);            // writes accessory requested characteristic ids to hapOut stream - returns true if all characteristics are found and readable, else returns false
   void clearNotify(int slotNum);                                          // set ev notification flags for connection 'slotNum' to false across all characteristics 
   void printfNotify(SpanBuf *pObj, int nObj, int conNum);                 // writes notification JSON to hapOut stream based on SpanBuf objects and specified connection number
+  int prepareNotifications();                                             // moves Notifications that are due (based on each Characteristic's notifyPolicy) to front of Notifications vector and returns their number
+  void clearNotifications(int nObj);                                      // removes first nObj Notifications (retaining capacity of vector) so those Characteristics can be queued again
+  uint32_t getSubscribers(SpanBuf *pObj, int nObj);                      // returns mask of connections that requested Event Notifications for at least one of the nObj updated characteristics in pObj
+  uint32_t getSubscriberGroup(SpanBuf *pObj, int nObj, int conNum, uint32_t mask);    // returns subset of connections in mask that requested Event Notifications for exactly the same updated characteristics in pObj as connection conNum
+  boolean saveValue(SpanCharacteristic *chr, boolean commit=true);        // saves value of chr in NVS, either immediately (if durable or queue interval is 0, committing unless commit=false) or by adding it to nvsQueue; returns true if value was written immediately
+  void queueValue(SpanCharacteristic *chr);                               // adds chr to nvsQueue (if not already queued)
+  void writeValue(SpanCharacteristic *chr);                               // writes value of chr to NVS (without committing)
+  boolean restoreValue(SpanCharacteristic *chr);                          // restores value of chr from NVS, migrating it into packed blob if needed; returns true if a saved value was found
+  void loadBlob(SpanAccessory *acc);                                      // reads packed NVS blob of acc into acc->nvsBlob
+  void writeBlob(SpanAccessory *acc);                                     // writes packed NVS blob with values of all stored Characteristics in acc (without committing)
+  boolean isStored(SpanAccessory *acc, int iid, uint32_t type);           // returns true if acc currently contains a stored Characteristic with matching iid and hash of type
+  void releaseBlobs();                                                    // frees packed NVS blobs read into each Accessory at startup
+  void discardValues();                                                   // discards all values in nvsQueue without saving them (used when NVS data is erased)
 
   static boolean invalidUUID(const char *uuid, boolean isCustom){
     int x=0;
@@ -385,6 +462,11 @@ class Span{
   TaskHandle_t getAutoPollTask(){return(pollTaskHandle);}
 
   Span& setTimeServerTimeout(uint32_t tSec){webLog.waitTime=tSec*1000;return(*this);}    // sets wait time (in seconds) for optional web log time server to connect
+
+  Span& setAccessoriesCache(boolean enable){accessoriesCache.enabled=enable;accessoriesCache.clear();return(*this);}     // enables/disables caching of GET /accessories response
+  Span& setNVSFlushInterval(uint32_t ms){nvsQueue.interval=ms;return(*this);}        // sets maximum time (in ms) changed Characteristic values are deferred before being saved in NVS (0=save immediately)
+  Span& setPackedNVS(boolean enable=true){packedNVS=enable;return(*this);}            // enables/disables saving Characteristic values in a single packed NVS blob per Accessory (must be called before any Characteristics are created)
+  void flushValues();                                                                 // writes and commits all deferred Characteristic values to NVS
  
   [[deprecated("Please use reserveSocketConnections(n) method instead.")]]
   void setMaxConnections(uint8_t n){requestedMaxCon=n;}                   // sets maximum number of simultaneous HAP connections
@@ -402,7 +484,13 @@ class SpanAccessory{
     
   uint32_t aid=0;                                         // Accessory Instance ID (HAP Table 6-1)
   int iidCount=0;                                         // running count of iid to use for Services and Characteristics associated with this Accessory                                 
+  uint8_t *nvsBlob=NULL;                                  // packed NVS blob of saved Characteristic values, read at startup when the first stored Characteristic is created (freed by updateDatabase())
+  size_t nvsBlobLen=0;                                    // length of nvsBlob
+  size_t nvsCursor=0;                                     // offset in nvsBlob at which to start searching for next Characteristic (records are stored in order of iid)
+  boolean nvsLoaded=false;                                // set to true once nvsBlob has been read
+  boolean nvsDirty=false;                                 // set to true when packed NVS blob needs to be re-written while flushing Span::nvsQueue
   vector<SpanService *, Mallocator<SpanService*>> Services;                         // vector of pointers to all Services in this Accessory  
+  vector<SpanCharacteristic *, Mallocator<SpanCharacteristic*>> iidIndex;           // pointers to Characteristics indexed by iid-1 (NULL for iids of Services), built by Span::buildIndex()
 
   void printfAttributes(int flags);                       // writes Accessory JSON to hapOut stream
 
@@ -434,8 +522,12 @@ class SpanService{
   vector<SpanService *, Mallocator<SpanService *>> linkedServices;                   // vector of pointers to any optional linked Services
   boolean isCustom;                                       // flag to indicate this is a Custom Service
   SpanAccessory *accessory=NULL;                          // pointer to Accessory containing this Service
+  const char *headerJSON=NULL;                            // precompiled JSON of Service properties that precede Characteristics (built on first use, and shared with identical Services)
+  StatusCode updateStatus=StatusCode::OK;                 // status returned by most recent call to update() from commitCharacteristics()
   
   void printfAttributes(int flags);                       // writes Service JSON to hapOut stream
+  void compileHeader();                                   // builds headerJSON
+  void invalidateHeader(){homeSpan.jsonFragments.release(headerJSON);headerJSON=NULL;homeSpan.accessoriesCache.clear();}     // discards headerJSON (called whenever Service properties change)
 
   protected:
   
@@ -459,10 +551,24 @@ class SpanService{
 
 ///////////////////////////////
 
+struct SpanNotifyPolicy {                   // optional Event Notification policy for a Characteristic (allocated only if one of the setNotify...() methods is called)
+  uint32_t interval=0;                      // minimum time (in ms) between Event Notifications; updates made sooner are deferred (and coalesced) until the interval has passed
+  double deadband=0;                        // minimum absolute change from last value notified that triggers an Event Notification
+  double relDeadband=0;                     // minimum change, relative to last value notified, that triggers an Event Notification
+  boolean onChange=false;                   // if true, setVal() and setString() are ignored (no Event Notification or NVS write) when value is unchanged
+  uint32_t lastTime=0;                      // time (in ms) of last Event Notification (0=none yet)
+  double lastValue=0;                       // value in last Event Notification
+
+  void *operator new(size_t size){return(HS_MALLOC(size));}     // override new operator to use PSRAM when available
+};
+
+///////////////////////////////
+
 class SpanCharacteristic{
 
   friend class Span;
   friend class SpanService;
+  template <FORMAT F> friend class SpanCharacteristicT;
 
   union UVal {                                  
     BOOL_t BOOL;
@@ -490,8 +596,14 @@ class SpanCharacteristic{
   boolean staticRange;                     // Flag that indicates whether Range is static and cannot be changed with setRange()
   boolean customRange=false;               // Flag for custom ranges
   char *validValues=NULL;                  // Optional JSON array of valid values.  Applicable only to uint8 Characteristics
-  boolean *ev;                             // Characteristic Event Notify Enable (per-connection)
+  uint16_t charNum;                        // dense characteristic number (index into Span::charTable) used to track per-connection Event Notification subscriptions
+  uint32_t subscribers=0;                  // bit n is set if connection n has requested Event Notifications for this Characteristic
+  boolean notifyPending=false;             // set to true when this Characteristic is in Span::Notifications (so it is queued at most once)
+  SpanNotifyPolicy *notifyPolicy=NULL;     // optional Event Notification policy (NULL=notify on every update)
   char *nvsKey=NULL;                       // key for NVS storage of Characteristic value
+  boolean nvsDirty=false;                  // set to true when value is queued in Span::nvsQueue waiting to be saved in NVS
+  boolean nvsDurable=false;                // if true, value is saved in NVS immediately whenever it changes, bypassing Span::nvsQueue
+  boolean nvsLegacy=false;                 // set to true if value was migrated from its own NVS entry into packed blob (entry is erased once blob is written)
   boolean isCustom;                        // flag to indicate this is a Custom Characteristic
   boolean setRangeError=false;             // flag to indicate attempt to set Range on Characteristic that does not support changes to Range
   boolean setValidValuesError=false;       // flag to indicate attempt to set Valid Values on Characteristic that does not support changes to Valid Values
@@ -501,35 +613,54 @@ class SpanCharacteristic{
   unsigned long updateTime=0;              // last time value was updated (in millis) either by PUT /characteristic OR by setVal()
   UVal newValue;                           // the updated value requested by PUT /characteristic
   SpanService *service=NULL;               // pointer to Service containing this Characteristic
+  const char *attrJSON=NULL;               // precompiled JSON of metadata, description, and permissions (built on first use, and shared with identical Characteristics)
+  size_t descOffset;                       // offset of description in attrJSON (size_t, since valid values and description are of unlimited length)
+  size_t permsOffset;                      // offset of permissions in attrJSON
+  size_t attrLen;                          // length of attrJSON
 
   void printfAttributes(int flags);               // writes Characteristic JSON to hapOut stream
+  void compileAttributes();                       // builds attrJSON
+  void invalidateAttributes(){homeSpan.jsonFragments.release(attrJSON);attrJSON=NULL;homeSpan.accessoriesCache.clear();}    // discards attrJSON (called whenever metadata, description, or permissions change)
   StatusCode loadUpdate(char *val, char *ev);     // load updated val/ev from PUT /characteristic JSON request.  Return intitial HAP status code (checks to see if characteristic is found, is writable, etc.)  
+  void setNotify(int conNum, boolean flag);       // sets/clears Event Notification request for this Characteristic from connection conNum
     
-  String uvPrint(UVal &u){
-    char c[67];               // space for 64 characters + surrounding quotes + terminating null
+  size_t uvFormat(UVal &u, char *c){        // writes numeric value into c (which must have space for 24 characters) without using the heap, and returns length
     switch(format){
       case FORMAT::BOOL:
-        return(String(u.BOOL));      
+        return(Utils::formatUInt(c,u.BOOL));      
       case FORMAT::INT:
-        return(String(u.INT));
+        return(Utils::formatInt(c,u.INT));
       case FORMAT::UINT8:
-        return(String(u.UINT8));        
+        return(Utils::formatUInt(c,u.UINT8));        
       case FORMAT::UINT16:
-        return(String(u.UINT16));        
+        return(Utils::formatUInt(c,u.UINT16));        
       case FORMAT::UINT32:
-        return(String(u.UINT32));        
+        return(Utils::formatUInt(c,u.UINT32));        
       case FORMAT::UINT64:
-        sprintf(c,"%llu",u.UINT64);
-        return(String(c));        
+        return(Utils::formatUInt(c,u.UINT64));        
       case FORMAT::FLOAT:
-        sprintf(c,"%g",u.FLOAT);
-        return(String(c));        
+        return(Utils::formatFloat(c,u.FLOAT));
+      default:
+        break;
+    } // switch
+    c[0]='\0';
+    return(0);
+  }
+
+  void uvWrite(UVal &u);                    // writes value as JSON directly to hapOut stream without using the heap (strings are escaped and truncated to 64 bytes)
+  size_t uvLength(UVal &u);                 // returns number of bytes uvWrite() writes for value
+
+  String uvPrint(UVal &u){                  // returns value as a String (used only for diagnostics and other non-time-critical output)
+    char c[67];               // space for 64 characters + surrounding quotes + terminating null
+    switch(format){
       case FORMAT::STRING:
       case FORMAT::DATA:
         sprintf(c,"\"%.64s\"",u.STRING);  // Truncating string to 64 chars
-        return(String(c));        
+        return(String(c));
+      default:
+        uvFormat(u,c);
+        return(String(c));
     } // switch
-    return(String());       // included to prevent compiler warnings
   }
 
   void uvSet(UVal &dest, UVal &src){
@@ -600,6 +731,48 @@ class SpanCharacteristic{
   protected:
 
   ~SpanCharacteristic();                                                  // destructor  
+
+  void queueNotification(){                 // queues an Event Notification for this Characteristic, unless one is already pending (the value is read when the Notification is sent, so it is always the latest)
+    if(notifyPending)
+      return;
+    notifyPending=true;
+    static char dummy[]="";
+    SpanBuf sb;                             // create SpanBuf object
+    sb.characteristic=this;                 // set characteristic          
+    sb.status=StatusCode::OK;               // set status
+    sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
+    homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector  
+  }
+
+  void commitVal(boolean notify, boolean changed){     // completes setVal() for numeric values once value and newValue have been set
+    
+    if(notifyPolicy && notifyPolicy->onChange && !changed)      // ignore unchanged value
+      return;
+
+    updateTime=homeSpan.snapTime;
+
+    if(notify){
+      if(!notifyPolicy || outsideDeadband())
+        queueNotification();
+  
+      if(nvsKey)
+        homeSpan.saveValue(this);
+    }
+  }
+
+  boolean outsideDeadband(){                // returns true if value has moved outside the deadband around the last value notified
+    double v=uvGet<double>(value);
+    double band=fmax(notifyPolicy->deadband,notifyPolicy->relDeadband*fabs(notifyPolicy->lastValue));
+    return(fabs(v-notifyPolicy->lastValue)>=band);
+  }
+
+  SpanNotifyPolicy *getNotifyPolicy(){      // returns notifyPolicy, creating it if needed
+    if(!notifyPolicy){
+      notifyPolicy=new SpanNotifyPolicy;
+      notifyPolicy->lastValue=uvGet<double>(value);
+    }
+    return(notifyPolicy);
+  }
     
   template <typename T, typename A=boolean, typename B=boolean> void init(T val, boolean nvsStore, A min=0, B max=1){
 
@@ -610,23 +783,9 @@ class SpanCharacteristic{
       uint16_t t;
       sscanf(type,"%hx",&t);
       sprintf(nvsKey,"%04X%08X%03X",t,aid,iid&0xFFF);
-      size_t len;    
-
-      if(format!=FORMAT::STRING && format!=FORMAT::DATA){
-        if(nvs_get_u64(homeSpan.charNVS,nvsKey,&(value.UINT64))!=ESP_OK) {
-          nvs_set_u64(homeSpan.charNVS,nvsKey,value.UINT64);                // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-          nvs_commit(homeSpan.charNVS);                                     // commit to NVS  
-        }     
-      } else {
-        if(!nvs_get_str(homeSpan.charNVS,nvsKey,NULL,&len)){
-          value.STRING = (char *)HS_REALLOC(value.STRING,len);
-          nvs_get_str(homeSpan.charNVS,nvsKey,value.STRING,&len);
-        }
-        else {
-          nvs_set_str(homeSpan.charNVS,nvsKey,value.STRING);               // store string data
-          nvs_commit(homeSpan.charNVS);                                    // commit to NVS  
-        }
-      }
+
+      if(!homeSpan.restoreValue(this))
+        homeSpan.queueValue(this);                                          // save initial value
     }
   
     uvSet(newValue,value);
@@ -673,22 +832,17 @@ class SpanCharacteristic{
       return;
     }
 
+    if(notifyPolicy && notifyPolicy->onChange && value.STRING && !strcmp(value.STRING,val))     // ignore unchanged value
+      return;
+
     uvSet(value,val);
     uvSet(newValue,value);
       
     updateTime=homeSpan.snapTime;
-    
-    SpanBuf sb;                             // create SpanBuf object
-    sb.characteristic=this;                 // set characteristic          
-    sb.status=StatusCode::OK;               // set status
-    char dummy[]="";
-    sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
-    homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector  
+    queueNotification();
 
-    if(nvsKey){
-      nvs_set_str(homeSpan.charNVS,nvsKey,value.STRING);    // store data
-      nvs_commit(homeSpan.charNVS);
-    }
+    if(nvsKey)
+      homeSpan.saveValue(this);
     
   } // setString()
 
@@ -759,30 +913,21 @@ class SpanCharacteristic{
       hapName,(double)val,uvGet<double>(minValue),uvGet<double>(maxValue));
     }
    
+    uint64_t oldBits=value.UINT64;          // comparing all bits of union detects a change in any numeric format
     uvSet(value,val);
     uvSet(newValue,value);
-      
-    updateTime=homeSpan.snapTime;
-
-    if(notify){
-      SpanBuf sb;                             // create SpanBuf object
-      sb.characteristic=this;                 // set characteristic          
-      sb.status=StatusCode::OK;               // set status
-      char dummy[]="";
-      sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
-      homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector  
-  
-      if(nvsKey){
-        nvs_set_u64(homeSpan.charNVS,nvsKey,value.UINT64);            // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-        nvs_commit(homeSpan.charNVS);
-      }
-    }
+    commitVal(notify,value.UINT64!=oldBits);
     
   } // setVal()
 
   boolean updated(){return(isUpdated);}             // returns isUpdated
   unsigned long timeVal();                          // returns time elapsed (in millis) since value was last updated
   
+  SpanCharacteristic *setNotifyInterval(uint32_t ms){getNotifyPolicy()->interval=ms;return(this);}     // sets minimum time (in ms) between Event Notifications and returns pointer to self
+  SpanCharacteristic *setNotifyDeadband(double absolute, double relative=0){getNotifyPolicy()->deadband=absolute;notifyPolicy->relDeadband=relative;return(this);}    // sets absolute and/or relative deadband for Event Notifications and returns pointer to self
+  SpanCharacteristic *setNotifyOnChange(boolean enable=true){getNotifyPolicy()->onChange=enable;return(this);}     // ignores setVal()/setString() calls that do not change value and returns pointer to self
+  SpanCharacteristic *setDurable(boolean durable=true){nvsDurable=durable;return(this);}                            // saves value in NVS immediately whenever it changes (rather than deferring it) and returns pointer to self
+
   SpanCharacteristic *setValidValues(int n, ...);   // sets a list of 'n' valid values allowed for a Characteristic and returns pointer to self.  Only applicable if format=INT, UINT8, UINT16, or UINT32
 
   template <typename A, typename B, typename S=int> SpanCharacteristic *setRange(A min, B max, S step=0){
@@ -792,6 +937,7 @@ class SpanCharacteristic{
       uvSet(maxValue,max);
       uvSet(stepValue,step);  
       customRange=true; 
+      invalidateAttributes();
     } else
       setRangeError=true;
       
@@ -803,6 +949,7 @@ class SpanCharacteristic{
     perms&=0x7F;
     if(perms>0)
       this->perms=perms;
+    invalidateAttributes();
     return(this);
   }
 
@@ -817,12 +964,14 @@ class SpanCharacteristic{
   SpanCharacteristic *setDescription(const char *c){
     desc = (char *)HS_REALLOC(desc, strlen(c) + 1);
     strcpy(desc, c);
+    invalidateAttributes();
     return(this);
   }  
 
   SpanCharacteristic *setUnit(const char *c){
     unit = (char *)HS_REALLOC(unit, strlen(c) + 1);
     strcpy(unit, c);
+    invalidateAttributes();
     return(this);
   }  
 
@@ -830,6 +979,69 @@ class SpanCharacteristic{
 
 ///////////////////////////////
 
+// SpanFormat<F> maps each numeric FORMAT to its native type and to the corresponding member of the UVal union
+
+template <FORMAT F> struct SpanFormat {};
+
+template <> struct SpanFormat<FORMAT::BOOL>   { typedef BOOL_t type;   template <class U> static type &ref(U &u){return(u.BOOL);} };
+template <> struct SpanFormat<FORMAT::UINT8>  { typedef UINT8_t type;  template <class U> static type &ref(U &u){return(u.UINT8);} };
+template <> struct SpanFormat<FORMAT::UINT16> { typedef UINT16_t type; template <class U> static type &ref(U &u){return(u.UINT16);} };
+template <> struct SpanFormat<FORMAT::UINT32> { typedef UINT32_t type; template <class U> static type &ref(U &u){return(u.UINT32);} };
+template <> struct SpanFormat<FORMAT::UINT64> { typedef UINT64_t type; template <class U> static type &ref(U &u){return(u.UINT64);} };
+template <> struct SpanFormat<FORMAT::INT>    { typedef INT_t type;    template <class U> static type &ref(U &u){return(u.INT);} };
+template <> struct SpanFormat<FORMAT::FLOAT>  { typedef FLOAT_t type;  template <class U> static type &ref(U &u){return(u.FLOAT);} };
+
+///////////////////////////////
+
+// SpanCharacteristicT<F> is an optional typed layer over SpanCharacteristic for numeric formats.  Because the format is known at compile time,
+// getVal(), getNewVal(), and setVal() access the UVal union directly rather than switching on the run-time format.  All other methods,
+// and access through a SpanCharacteristic pointer, are unchanged.
+
+template <FORMAT F> class SpanCharacteristicT : public SpanCharacteristic {
+
+  typedef SpanFormat<F> SF;
+
+  public:
+
+  SpanCharacteristicT(HapChar *hapChar, boolean isCustom=false) : SpanCharacteristic(hapChar,isCustom) {
+    if(hapChar->format!=F){
+      LOG0("\nFATAL ERROR!  Can't create typed Characteristic '%s' with format that does not match HAP format ***\n",hapChar->hapName);
+      LOG0("\n=== PROGRAM HALTED ===");
+      while(1);
+    }
+  }
+
+  template <class T=int> T getVal(){
+    return((T)SF::ref(value));
+  }
+
+  template <class T=int> T getNewVal(){
+    return((T)SF::ref(newValue));
+  }
+
+  template <typename T> void setVal(T val, boolean notify=true){
+
+    if((perms & EV) == 0){
+      LOG0("\n*** WARNING:  Attempt to update Characteristic::%s with setVal() ignored.  No NOTIFICATION permission on this characteristic\n\n",hapName);
+      return;
+    }
+
+    if(!((val >= (T)SF::ref(minValue)) && (val <= (T)SF::ref(maxValue)))){
+      LOG0("\n*** WARNING:  Attempt to update Characteristic::%s with setVal(%g) is out of range [%g,%g].  This may cause device to become non-responsive!\n\n",
+      hapName,(double)val,(double)SF::ref(minValue),(double)SF::ref(maxValue));
+    }
+
+    boolean changed=(SF::ref(value)!=(typename SF::type)val);
+    SF::ref(value)=(typename SF::type)val;
+    SF::ref(newValue)=SF::ref(value);
+    commitVal(notify,changed);
+    
+  } // setVal()
+
+};
+
+///////////////////////////////
+
 struct [[deprecated("Please use Characteristic::setRange() method instead.")]] SpanRange{
   SpanRange(int min, int max, int step);
 };
@@ -472,10 +472,20 @@ namespace Service {
 // SPAN CHARACTERISTICS (HAP Chapter 9) //
 //////////////////////////////////////////
 
+// SpanTyped<TYPE>::base selects the typed base class (SpanCharacteristicT) for each numeric TYPE used below, and the untyped SpanCharacteristic for all others
+
+template <class T> struct SpanTyped { typedef SpanCharacteristic base; };
+
+template <> struct SpanTyped<boolean>  { typedef SpanCharacteristicT<FORMAT::BOOL> base; };
+template <> struct SpanTyped<uint8_t>  { typedef SpanCharacteristicT<FORMAT::UINT8> base; };
+template <> struct SpanTyped<uint32_t> { typedef SpanCharacteristicT<FORMAT::UINT32> base; };
+template <> struct SpanTyped<int>      { typedef SpanCharacteristicT<FORMAT::INT> base; };
+template <> struct SpanTyped<double>   { typedef SpanCharacteristicT<FORMAT::FLOAT> base; };
+
 // Macro to define Span Characteristic structures based on name of HAP Characteristic, default value, and min/max value (not applicable for STRING or BOOL which default to min=0, max=1)
 
 #define CREATE_CHAR(TYPE,HAPCHAR,DEFVAL,MINVAL,MAXVAL,...) \
-  struct HAPCHAR : SpanCharacteristic { __VA_OPT__(enum{) __VA_ARGS__ __VA_OPT__(};) HAPCHAR(TYPE val=DEFVAL, boolean nvsStore=false) : SpanCharacteristic {&hapChars.HAPCHAR} { init(val,nvsStore,(TYPE)MINVAL,(TYPE)MAXVAL); } };
+  struct HAPCHAR : SpanTyped<TYPE>::base { __VA_OPT__(enum{) __VA_ARGS__ __VA_OPT__(};) HAPCHAR(TYPE val=DEFVAL, boolean nvsStore=false) : SpanTyped<TYPE>::base {&hapChars.HAPCHAR} { init(val,nvsStore,(TYPE)MINVAL,(TYPE)MAXVAL); } };
 
 namespace Characteristic {
 
@@ -606,7 +616,7 @@ namespace Characteristic {
 
 #define CUSTOM_CHAR(NAME,UUID,PERMISISONS,FORMAT,DEFVAL,MINVAL,MAXVAL,STATIC_RANGE) \
   HapChar _CUSTOM_##NAME {#UUID,#NAME,(PERMS)(PERMISISONS),FORMAT,STATIC_RANGE}; \
-  namespace Characteristic { struct NAME : SpanCharacteristic { NAME(FORMAT##_t val=DEFVAL, boolean nvsStore=false) : SpanCharacteristic {&_CUSTOM_##NAME,true} { init(val,nvsStore,(FORMAT##_t)MINVAL,(FORMAT##_t)MAXVAL); } }; }
+  namespace Characteristic { struct NAME : SpanCharacteristicT<FORMAT> { NAME(FORMAT##_t val=DEFVAL, boolean nvsStore=false) : SpanCharacteristicT<FORMAT> {&_CUSTOM_##NAME,true} { init(val,nvsStore,(FORMAT##_t)MINVAL,(FORMAT##_t)MAXVAL); } }; }
 
 #define CUSTOM_CHAR_STRING(NAME,UUID,PERMISISONS,DEFVAL) \
   HapChar _CUSTOM_##NAME {#UUID,#NAME,(PERMS)(PERMISISONS),STRING,true}; \
@@ -620,7 +630,7 @@ namespace Characteristic {
 
 #define CUSTOM_CHAR(NAME,UUID,PERMISISONS,FORMAT,DEFVAL,MINVAL,MAXVAL,STATIC_RANGE) \
   extern HapChar _CUSTOM_##NAME; \
-  namespace Characteristic { struct NAME : SpanCharacteristic { NAME(FORMAT##_t val=DEFVAL, boolean nvsStore=false) : SpanCharacteristic {&_CUSTOM_##NAME,true} { init(val,nvsStore,(FORMAT##_t)MINVAL,(FORMAT##_t)MAXVAL); } }; }
+  namespace Characteristic { struct NAME : SpanCharacteristicT<FORMAT> { NAME(FORMAT##_t val=DEFVAL, boolean nvsStore=false) : SpanCharacteristicT<FORMAT> {&_CUSTOM_##NAME,true} { init(val,nvsStore,(FORMAT##_t)MINVAL,(FORMAT##_t)MAXVAL); } }; }
 
 #define CUSTOM_CHAR_STRING(NAME,UUID,PERMISISONS,DEFVAL) \
   extern HapChar _CUSTOM_##NAME; \
@@ -34,6 +34,9 @@
 //
 //  Utils::readSerial       - reads all characters from Serial port and saves only up to max specified
 //  Utils::mask             - masks a string with asterisks (good for displaying passwords)
+//  Utils::formatUInt       - heap-free conversion of unsigned integers to decimal text
+//  Utils::formatInt        - heap-free conversion of signed integers to decimal text
+//  Utils::formatFloat      - heap-free conversion of floats to the shortest decimal text that reads back as the same float
 //
 //  class PushButton        - tracks Single, Double, and Long Presses of a pushbutton that connects a specified pin to ground
 //
@@ -87,6 +90,276 @@ String Utils::mask(char *c, int n){
   return(s);  
 } // mask
 
+//////////////////////////////////////
+
+size_t Utils::formatUInt(char *c, uint64_t n){
+
+  char buf[20];
+  char *p=buf+sizeof(buf);
+
+  if(n>UINT32_MAX){                   // use (slower) 64-bit arithmetic only until remainder fits in 32 bits
+    do {
+      *--p='0'+n%10;
+      n/=10;
+    } while(n>UINT32_MAX);
+  }
+
+  uint32_t n32=n;
+  do {
+    *--p='0'+n32%10;
+    n32/=10;
+  } while(n32>0);
+
+  size_t len=buf+sizeof(buf)-p;
+  memcpy(c,p,len);
+  c[len]='\0';
+  return(len);
+} // formatUInt
+
+//////////////////////////////////////
+
+size_t Utils::formatInt(char *c, int64_t n){
+
+  if(n>=0)
+    return(formatUInt(c,n));
+
+  c[0]='-';
+  return(formatUInt(c+1,-(uint64_t)n)+1);
+} // formatInt
+
+//////////////////////////////////////
+
+static double powerOf10(int k){         // returns 10^k using exact powers of 10 where possible
+
+  static const double p10[]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+
+  if(k<0)
+    return(1.0/powerOf10(-k));
+
+  double x=1.0;
+  while(k>22){
+    x*=p10[22];
+    k-=22;
+  }
+  return(x*p10[k]);
+}
+
+size_t Utils::formatFloat(char *c, float f){
+
+  if(isnan(f) || isinf(f)){             // not representable in JSON
+    strcpy(c,"null");
+    return(4);
+  }
+
+  if(f==0){
+    strcpy(c,"0");
+    return(1);
+  }
+
+  char *p=c;
+  double x=f;                           // a float is exactly representable as a double
+
+  if(x<0){
+    *p++='-';
+    x=-x;
+  }
+
+  int e;
+  frexp(x,&e);
+  e=floor((e-1)*0.30102999566398);      // estimate decimal exponent from binary exponent...
+  if(x>=powerOf10(e+1))                     // ...and correct if needed, so that 10^e <= x < 10^(e+1)
+    e++;
+  else if(x<powerOf10(e))
+    e--;
+
+  uint32_t digits;
+  int nDigits;
+
+  for(nDigits=1;nDigits<9;nDigits++){   // find smallest number of significant digits that reads back as the same float (never more than 9)
+    int k=nDigits-1-e;
+    digits=llround(k>=0?x*powerOf10(k):x/powerOf10(-k));
+    if((float)(k>=0?digits/powerOf10(k):digits*powerOf10(-k))==(float)x)
+      break;
+  }
+
+  if(nDigits==9){
+    int k=8-e;
+    digits=llround(k>=0?x*powerOf10(k):x/powerOf10(-k));
+  }
+
+  if(digits>=powerOf10(nDigits)){           // rounding carried into an additional digit (e.g. 9.99 -> 10.0)
+    digits/=10;
+    e++;
+  }
+
+  while(nDigits>1 && digits%10==0){     // remove trailing zeros
+    digits/=10;
+    nDigits--;
+  }
+
+  char d[10];
+  for(int i=nDigits-1;i>=0;i--){
+    d[i]='0'+digits%10;
+    digits/=10;
+  }
+
+  if(e>=-5 && e<=15){                   // use fixed notation (e.g. 123.45 or 0.00123)
+    if(e<0){
+      *p++='0';
+      *p++='.';
+      for(int i=-1;i>e;i--)
+        *p++='0';
+      memcpy(p,d,nDigits);
+      p+=nDigits;
+    } else {
+      for(int i=0;i<nDigits || i<=e;i++){
+        if(i==e+1)
+          *p++='.';
+        *p++=i<nDigits?d[i]:'0';
+      }
+    }
+  } else {                              // use exponential notation (e.g. 1.5e-07 or 3.4e+38)
+    *p++=d[0];
+    if(nDigits>1){
+      *p++='.';
+      memcpy(p,d+1,nDigits-1);
+      p+=nDigits-1;
+    }
+    *p++='e';
+    *p++=e<0?'-':'+';
+    if(e<0)
+      e=-e;
+    if(e<10)
+      *p++='0';
+    p+=formatUInt(p,e);
+  }
+
+  *p='\0';
+  return(p-c);
+} // formatFloat
+
+//////////////////////////////////////
+
+boolean Utils::parseBool(const char *c, boolean &b){
+
+  switch(c[0]){
+    case '0': b=false; return(c[1]=='\0');
+    case '1': b=true; return(c[1]=='\0');
+    case 'f': b=false; return(!strcmp(c,"false"));
+    case 't': b=true; return(!strcmp(c,"true"));
+  }
+
+  return(false);
+} // parseBool
+
+//////////////////////////////////////
+
+boolean Utils::parseUInt(const char *c, uint64_t max, uint64_t &n){
+
+  if(*c=='t' || *c=='f'){               // HomeKit may write booleans to integer Characteristics
+    boolean b;
+    n=0;
+    if(!parseBool(c,b))
+      return(false);
+    n=b;
+    return(n<=max);
+  }
+
+  if(*c<'0' || *c>'9')
+    return(false);
+
+  for(n=0;*c>='0' && *c<='9';c++){
+    uint32_t d=*c-'0';
+    if(d>max || n>(max-d)/10)           // n*10+d would exceed max (this also detects 64-bit overflow)
+      return(false);
+    n=n*10+d;
+  }
+
+  if(*c=='.'){                          // accept integral decimals (e.g. "1.0"), which some controllers send for integer Characteristics
+    if(c[1]<'0' || c[1]>'9')
+      return(false);
+    for(c++;*c=='0';c++);
+  }
+
+  return(*c=='\0');
+} // parseUInt
+
+//////////////////////////////////////
+
+boolean Utils::parseInt(const char *c, int64_t min, int64_t max, int64_t &n){
+
+  uint64_t u;
+
+  if(*c!='-'){
+    if(!parseUInt(c,max,u))
+      return(false);
+    n=u;
+    return(true);
+  }
+
+  if(c[1]<'0' || c[1]>'9' || !parseUInt(c+1,0-(uint64_t)min,u))
+    return(false);
+
+  n=(int64_t)(0-u);
+  return(true);
+} // parseInt
+
+//////////////////////////////////////
+
+boolean Utils::parseFloat(const char *c, double &x){
+
+  boolean neg=(*c=='-');
+  if(neg)
+    c++;
+
+  if(*c<'0' || *c>'9' || (c[0]=='0' && c[1]>='0' && c[1]<='9'))       // JSON requires an integer part with no leading zeros (e.g. ".5" and "01" are invalid)
+    return(false);
+
+  uint64_t m=0;                         // first 18 significant digits are accumulated into m, so that x = m * 10^e
+  int e=0;
+
+  for(;*c>='0' && *c<='9';c++){
+    if(m<100000000000000000ULL)
+      m=m*10+(*c-'0');
+    else
+      e++;
+  }
+
+  if(*c=='.'){
+    if(c[1]<'0' || c[1]>'9')            // JSON requires at least one digit following decimal point (e.g. "1." is invalid)
+      return(false);
+    for(c++;*c>='0' && *c<='9';c++){
+      if(m<100000000000000000ULL){
+        m=m*10+(*c-'0');
+        e--;
+      }
+    }
+  }
+
+  if(*c=='e' || *c=='E'){
+    c++;
+    boolean eNeg=(*c=='-');
+    if(*c=='-' || *c=='+')
+      c++;
+    if(*c<'0' || *c>'9')
+      return(false);
+    int k=0;
+    for(;*c>='0' && *c<='9';c++)
+      if(k<1000)
+        k=k*10+(*c-'0');
+    e+=eNeg?-k:k;
+  }
+
+  if(*c!='\0')
+    return(false);
+
+  x=(e>=0)?m*powerOf10(e):m/powerOf10(-e);
+  if(neg)
+    x=-x;
+
+  return(isfinite(x));
+} // parseFloat
+
 ////////////////////////////////
 //         PushButton         //
 ////////////////////////////////
@@ -35,6 +35,15 @@ namespace Utils {
 
 char *readSerial(char *c, int max);   // read serial port into 'c' until <newline>, but storing only first 'max' characters (the rest are discarded)
 String mask(char *c, int n);          // simply utility that creates a String from 'c' with all except the first and last 'n' characters replaced by '*'
+
+size_t formatUInt(char *c, uint64_t n);   // writes decimal representation of 'n' into 'c' (which must have space for 21 characters), and returns length
+size_t formatInt(char *c, int64_t n);     // writes decimal representation of 'n' into 'c' (which must have space for 21 characters), and returns length
+size_t formatFloat(char *c, float f);     // writes shortest JSON representation of 'f' that reads back as the same float into 'c' (which must have space for 24 characters), and returns length
+
+boolean parseBool(const char *c, boolean &b);                       // parses "true", "false", "1" or "0" into 'b'; returns false if 'c' is not a valid boolean
+boolean parseUInt(const char *c, uint64_t max, uint64_t &n);        // parses decimal integer (or true/false as 1/0, or integral decimal such as 1.0) no greater than 'max' into 'n'; returns false if 'c' is malformed, has a non-zero fraction or trailing characters, or exceeds 'max'
+boolean parseInt(const char *c, int64_t min, int64_t max, int64_t &n);   // same as parseUInt() but allows a leading minus sign, with 'min' <= 0 <= 'max'
+boolean parseFloat(const char *c, double &x);                       // parses JSON number into 'x'; returns false if 'c' is malformed, has trailing characters, or is not finite
   
 }
 